@@ -6,19 +6,26 @@
  */
 
 #include <linux/acpi.h>
+#include <linux/debugfs.h>
 #include <linux/gpio/driver.h>
 #include <linux/irq.h>
 #include <linux/kernel.h>
 #include <linux/kref.h>
+#include <linux/ktime.h>
 #include <linux/mfd/ljca.h>
 #include <linux/module.h>
 #include <linux/platform_device.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/types.h>
+#include <linux/wait.h>
 #include <linux/bitops.h>
 
 #define GPIO_PAYLOAD_LEN(pin_num)                                              \
 	(sizeof(struct gpio_packet) + (pin_num) * sizeof(struct gpio_op))
+/* pins a payload of len bytes holds */
+#define GPIO_PACKET_PINS(len)                                                  \
+	(((len) - sizeof(struct gpio_packet)) / sizeof(struct gpio_op))
 
 /* GPIO commands */
 #define GPIO_CONFIG 1
@@ -44,6 +51,11 @@
 #define GPIO_CONF_SET BIT(3)
 #define GPIO_CONF_CLR BIT(4)
 
+static unsigned int input_cache_us;
+module_param(input_cache_us, uint, 0644);
+MODULE_PARM_DESC(input_cache_us,
+		 "Serve input reads from a read this recent, in us (0 = off)");
+
 struct gpio_op {
 	u8 index;
 	u8 value;
@@ -66,7 +78,26 @@ struct ljca_gpio_dev {
 	struct work_struct work;
 	struct mutex trans_lock;
 
-	u8 obuf[256];
+	/* async commands not ended yet, remove waits for them */
+	atomic_t async_pending;
+	wait_queue_head_t async_wq;
+
+	/* IRQ mask/unmask items sent and the packets they took */
+	atomic_long_t irq_ops;
+	atomic_long_t irq_xfers;
+	struct dentry *debugfs_dir;
+
+	/*
+	 * value shadow: pins in out_dirs read back out_values, inputs read
+	 * less than input_cache_us ago read back in_values
+	 */
+	DECLARE_BITMAP(out_dirs, MAX_GPIO_NUM);
+	DECLARE_BITMAP(out_values, MAX_GPIO_NUM);
+	DECLARE_BITMAP(in_values, MAX_GPIO_NUM);
+	u64 read_ns[MAX_GPIO_NUM];
+	atomic_long_t cache_hits;
+	atomic_long_t cache_misses;
+
 	u8 ibuf[256];
 };
 
@@ -82,69 +113,278 @@ static bool ljca_gpio_valid(struct ljca_gpio_dev *ljca_gpio, int gpio_id)
 	return true;
 }
 
+static bool ljca_gpio_valid_mask(struct ljca_gpio_dev *ljca_gpio,
+				 const unsigned long *mask)
+{
+	int gpio_id;
+
+	for_each_set_bit (gpio_id, mask, ljca_gpio->gc.ngpio) {
+		if (!ljca_gpio_valid(ljca_gpio, gpio_id))
+			return false;
+	}
+
+	return true;
+}
+
+static void ljca_gpio_async_put(struct ljca_gpio_dev *ljca_gpio)
+{
+	if (atomic_dec_and_test(&ljca_gpio->async_pending))
+		wake_up(&ljca_gpio->async_wq);
+}
+
+static int ljca_gpio_send_packet(struct ljca_gpio_dev *ljca_gpio, u8 cmd,
+				 struct gpio_packet *packet,
+				 ljca_complete_cb_t complete)
+{
+	int ret;
+
+	if (complete) {
+		atomic_inc(&ljca_gpio->async_pending);
+		ret = ljca_transfer_tx_buf_async(ljca_gpio->pdev, cmd, packet,
+						 GPIO_PAYLOAD_LEN(packet->num),
+						 NULL, complete, ljca_gpio);
+		if (ret)
+			ljca_gpio_async_put(ljca_gpio);
+		return ret;
+	}
+
+	return ljca_transfer_tx_buf(ljca_gpio->pdev, cmd, packet,
+				    GPIO_PAYLOAD_LEN(packet->num), NULL, NULL);
+}
+
+/*
+ * Send one item per pin in @mask with the value values[pin], or 0 without
+ * @values, packing as many items into each packet as the payload holds.
+ * With @complete the packets are queued without waiting for their ACKs.
+ * Returns the number of packets sent.
+ */
+static int ljca_gpio_send_items(struct ljca_gpio_dev *ljca_gpio, u8 cmd,
+				const unsigned long *mask, const u8 *values,
+				ljca_complete_cb_t complete)
+{
+	struct gpio_packet *packet = NULL;
+	int packets = 0;
+	int gpio_id;
+	int max = 0;
+	int len;
+	int ret;
+
+	for_each_set_bit (gpio_id, mask, ljca_gpio->gc.ngpio) {
+		if (!packet) {
+			packet = ljca_get_tx_buf(ljca_gpio->pdev, &len);
+			if (!packet)
+				return -ENODEV;
+
+			max = GPIO_PACKET_PINS(len);
+			packet->num = 0;
+		}
+
+		packet->item[packet->num].index = gpio_id;
+		packet->item[packet->num].value = values ? values[gpio_id] : 0;
+		if (++packet->num < max)
+			continue;
+
+		ret = ljca_gpio_send_packet(ljca_gpio, cmd, packet, complete);
+		packet = NULL;
+		if (ret)
+			return ret;
+
+		packets++;
+	}
+
+	if (packet) {
+		ret = ljca_gpio_send_packet(ljca_gpio, cmd, packet, complete);
+		if (ret)
+			return ret;
+
+		packets++;
+	}
+
+	return packets;
+}
+
+static int gpio_config_multiple(struct ljca_gpio_dev *ljca_gpio,
+				const unsigned long *mask, u8 config)
+{
+	u8 values[MAX_GPIO_NUM];
+	int gpio_id;
+	int ret;
+
+	if (!ljca_gpio_valid_mask(ljca_gpio, mask))
+		return -EINVAL;
+
+	/* the shadow is trusted again once direction_output() succeeded */
+	for_each_set_bit (gpio_id, mask, ljca_gpio->gc.ngpio) {
+		values[gpio_id] = config | ljca_gpio->connect_mode[gpio_id];
+		clear_bit(gpio_id, ljca_gpio->out_dirs);
+		ljca_gpio->read_ns[gpio_id] = 0;
+	}
+
+	ret = ljca_gpio_send_items(ljca_gpio, GPIO_CONFIG, mask, values, NULL);
+	return ret < 0 ? ret : 0;
+}
+
 static int gpio_config(struct ljca_gpio_dev *ljca_gpio, u8 gpio_id, u8 config)
 {
-	struct gpio_packet *packet = (struct gpio_packet *)ljca_gpio->obuf;
+	DECLARE_BITMAP(mask, MAX_GPIO_NUM) = {};
+
+	__set_bit(gpio_id, mask);
+	return gpio_config_multiple(ljca_gpio, mask, config);
+}
+
+/* read the pins in @mask into @bits, as many per packet as fit */
+static int ljca_gpio_read_hw(struct ljca_gpio_dev *ljca_gpio,
+				   const unsigned long *mask,
+				   unsigned long *bits)
+{
+	struct gpio_packet *ack_packet;
+	struct gpio_packet *packet;
+	u8 ids[MAX_GPIO_NUM];
+	int gpio_id;
+	int ibuf_len;
+	int num = 0;
+	u64 now;
+	int count;
+	int len;
 	int ret;
+	int i;
+	int j;
 
-	if (!ljca_gpio_valid(ljca_gpio, gpio_id))
+	if (!ljca_gpio_valid_mask(ljca_gpio, mask))
 		return -EINVAL;
 
+	for_each_set_bit (gpio_id, mask, ljca_gpio->gc.ngpio)
+		ids[num++] = gpio_id;
+
 	mutex_lock(&ljca_gpio->trans_lock);
-	packet->item[0].index = gpio_id;
-	packet->item[0].value = config | ljca_gpio->connect_mode[gpio_id];
-	packet->num = 1;
+	ack_packet = (struct gpio_packet *)ljca_gpio->ibuf;
+	for (i = 0; i < num; i += count) {
+		packet = ljca_get_tx_buf(ljca_gpio->pdev, &len);
+		if (!packet) {
+			ret = -ENODEV;
+			goto out;
+		}
+
+		count = min_t(int, num - i, GPIO_PACKET_PINS(len));
+		packet->num = count;
+		for (j = 0; j < count; j++)
+			packet->item[j].index = ids[i + j];
+
+		ret = ljca_transfer_tx_buf(ljca_gpio->pdev, GPIO_READ, packet,
+					   GPIO_PAYLOAD_LEN(count),
+					   ljca_gpio->ibuf, &ibuf_len);
+		if (ret || !ibuf_len || ack_packet->num != count) {
+			dev_err(&ljca_gpio->pdev->dev,
+				"%s failed gpio_id:%d ret %d %d", __func__,
+				ids[i], ret, ack_packet->num);
+			ret = -EIO;
+			goto out;
+		}
 
-	ret = ljca_transfer(ljca_gpio->pdev, GPIO_CONFIG, packet,
-			    GPIO_PAYLOAD_LEN(packet->num), NULL, NULL);
+		now = ktime_get_ns();
+		for (j = 0; j < count; j++) {
+			gpio_id = ids[i + j];
+			__assign_bit(gpio_id, bits,
+				     ack_packet->item[j].value > 0);
+			assign_bit(gpio_id, ljca_gpio->in_values,
+				   ack_packet->item[j].value > 0);
+			ljca_gpio->read_ns[gpio_id] = now;
+		}
+	}
+
+	ret = 0;
+out:
 	mutex_unlock(&ljca_gpio->trans_lock);
 	return ret;
 }
 
+/*
+ * Serve outputs from the value last written and, with input_cache_us set,
+ * inputs read that recently from the value read, the rest from the device.
+ */
+static int ljca_gpio_read_multiple(struct ljca_gpio_dev *ljca_gpio,
+				   const unsigned long *mask,
+				   unsigned long *bits)
+{
+	DECLARE_BITMAP(miss, MAX_GPIO_NUM) = {};
+	u64 window = (u64)READ_ONCE(input_cache_us) * NSEC_PER_USEC;
+	u64 now = ktime_get_ns();
+	int hits = 0;
+	int gpio_id;
+
+	for_each_set_bit (gpio_id, mask, ljca_gpio->gc.ngpio) {
+		if (test_bit(gpio_id, ljca_gpio->out_dirs)) {
+			__assign_bit(gpio_id, bits,
+				     test_bit(gpio_id, ljca_gpio->out_values));
+		} else if (window && ljca_gpio->read_ns[gpio_id] &&
+			   now - ljca_gpio->read_ns[gpio_id] < window) {
+			__assign_bit(gpio_id, bits,
+				     test_bit(gpio_id, ljca_gpio->in_values));
+		} else {
+			__set_bit(gpio_id, miss);
+			continue;
+		}
+
+		hits++;
+	}
+
+	atomic_long_add(hits, &ljca_gpio->cache_hits);
+	if (bitmap_empty(miss, ljca_gpio->gc.ngpio))
+		return 0;
+
+	atomic_long_add(bitmap_weight(miss, ljca_gpio->gc.ngpio),
+			&ljca_gpio->cache_misses);
+	return ljca_gpio_read_hw(ljca_gpio, miss, bits);
+}
+
 static int ljca_gpio_read(struct ljca_gpio_dev *ljca_gpio, u8 gpio_id)
 {
-	struct gpio_packet *packet = (struct gpio_packet *)ljca_gpio->obuf;
-	struct gpio_packet *ack_packet;
+	DECLARE_BITMAP(mask, MAX_GPIO_NUM) = {};
+	DECLARE_BITMAP(bits, MAX_GPIO_NUM) = {};
 	int ret;
-	int ibuf_len;
 
-	if (!ljca_gpio_valid(ljca_gpio, gpio_id))
-		return -EINVAL;
+	__set_bit(gpio_id, mask);
+	ret = ljca_gpio_read_multiple(ljca_gpio, mask, bits);
+	if (ret)
+		return ret;
 
-	mutex_lock(&ljca_gpio->trans_lock);
-	packet->num = 1;
-	packet->item[0].index = gpio_id;
-	ret = ljca_transfer(ljca_gpio->pdev, GPIO_READ, packet,
-			    GPIO_PAYLOAD_LEN(packet->num), ljca_gpio->ibuf,
-			    &ibuf_len);
+	return test_bit(gpio_id, bits);
+}
 
-	ack_packet = (struct gpio_packet *)ljca_gpio->ibuf;
-	if (ret || !ibuf_len || ack_packet->num != packet->num) {
-		dev_err(&ljca_gpio->pdev->dev, "%s failed gpio_id:%d ret %d %d",
-			__func__, gpio_id, ret, ack_packet->num);
-		mutex_unlock(&ljca_gpio->trans_lock);
-		return -EIO;
+static int ljca_gpio_write_multiple(struct ljca_gpio_dev *ljca_gpio,
+				    const unsigned long *mask,
+				    const unsigned long *bits)
+{
+	u8 values[MAX_GPIO_NUM];
+	int gpio_id;
+	int ret;
+
+	for_each_set_bit (gpio_id, mask, ljca_gpio->gc.ngpio)
+		values[gpio_id] = test_bit(gpio_id, bits);
+
+	ret = ljca_gpio_send_items(ljca_gpio, GPIO_WRITE, mask, values, NULL);
+	if (ret < 0) {
+		/* unknown what reached the pins, read them back from now on */
+		for_each_set_bit (gpio_id, mask, ljca_gpio->gc.ngpio)
+			clear_bit(gpio_id, ljca_gpio->out_dirs);
+		return ret;
 	}
 
-	mutex_unlock(&ljca_gpio->trans_lock);
-	return (ack_packet->item[0].value > 0) ? 1 : 0;
+	for_each_set_bit (gpio_id, mask, ljca_gpio->gc.ngpio)
+		assign_bit(gpio_id, ljca_gpio->out_values,
+			   test_bit(gpio_id, bits));
+	return 0;
 }
 
 static int ljca_gpio_write(struct ljca_gpio_dev *ljca_gpio, u8 gpio_id,
 			   int value)
 {
-	struct gpio_packet *packet = (struct gpio_packet *)ljca_gpio->obuf;
-	int ret;
-
-	mutex_lock(&ljca_gpio->trans_lock);
-	packet->num = 1;
-	packet->item[0].index = gpio_id;
-	packet->item[0].value = (value & 1);
+	DECLARE_BITMAP(mask, MAX_GPIO_NUM) = {};
+	DECLARE_BITMAP(bits, MAX_GPIO_NUM) = {};
 
-	ret = ljca_transfer(ljca_gpio->pdev, GPIO_WRITE, packet,
-			    GPIO_PAYLOAD_LEN(packet->num), NULL, NULL);
-	mutex_unlock(&ljca_gpio->trans_lock);
-	return ret;
+	__set_bit(gpio_id, mask);
+	__assign_bit(gpio_id, bits, value & 1);
+	return ljca_gpio_write_multiple(ljca_gpio, mask, bits);
 }
 
 static int ljca_gpio_get_value(struct gpio_chip *chip, unsigned int offset)
@@ -167,6 +407,26 @@ static void ljca_gpio_set_value(struct gpio_chip *chip, unsigned int offset,
 			offset, val, ret);
 }
 
+static int ljca_gpio_get_multiple(struct gpio_chip *chip, unsigned long *mask,
+				  unsigned long *bits)
+{
+	struct ljca_gpio_dev *ljca_gpio = gpiochip_get_data(chip);
+
+	return ljca_gpio_read_multiple(ljca_gpio, mask, bits);
+}
+
+static void ljca_gpio_set_multiple(struct gpio_chip *chip, unsigned long *mask,
+				   unsigned long *bits)
+{
+	struct ljca_gpio_dev *ljca_gpio = gpiochip_get_data(chip);
+	int ret;
+
+	ret = ljca_gpio_write_multiple(ljca_gpio, mask, bits);
+	if (ret)
+		dev_err(chip->parent, "%s set values failed %d\n", __func__,
+			ret);
+}
+
 static int ljca_gpio_direction_input(struct gpio_chip *chip,
 				     unsigned int offset)
 {
@@ -187,6 +447,7 @@ static int ljca_gpio_direction_output(struct gpio_chip *chip,
 	if (ret)
 		return ret;
 
+	set_bit(offset, ljca_gpio->out_dirs);
 	ljca_gpio_set_value(chip, offset, val);
 	return 0;
 }
@@ -217,40 +478,62 @@ static int ljca_gpio_set_config(struct gpio_chip *chip, unsigned int offset,
 	return 0;
 }
 
-static int ljca_enable_irq(struct ljca_gpio_dev *ljca_gpio, int gpio_id,
-			   bool enable)
+static void ljca_gpio_irq_done(void *context, int status, int ibuf_len)
+{
+	struct ljca_gpio_dev *ljca_gpio = context;
+
+	if (status)
+		dev_err(&ljca_gpio->pdev->dev, "irq re-enable failed ret:%d\n",
+			status);
+
+	/* the last access, remove may free ljca_gpio once this is done */
+	ljca_gpio_async_put(ljca_gpio);
+}
+
+/* send one INT_MASK or INT_UNMASK item per pin in @mask, packed */
+static int ljca_gpio_irq_send(struct ljca_gpio_dev *ljca_gpio, bool unmask,
+			      const unsigned long *mask,
+			      ljca_complete_cb_t complete)
 {
-	struct gpio_packet *packet = (struct gpio_packet *)ljca_gpio->obuf;
+	int count = bitmap_weight(mask, ljca_gpio->gc.ngpio);
 	int ret;
 
-	mutex_lock(&ljca_gpio->trans_lock);
-	packet->num = 1;
-	packet->item[0].index = gpio_id;
-	packet->item[0].value = 0;
+	if (!count)
+		return 0;
 
-	dev_dbg(ljca_gpio->gc.parent, "%s %d", __func__, gpio_id);
+	dev_dbg(ljca_gpio->gc.parent, "%s %d pins %*pb\n", __func__, unmask,
+		ljca_gpio->gc.ngpio, mask);
 
-	ret = ljca_transfer(ljca_gpio->pdev,
-			    enable == true ? GPIO_INT_UNMASK : GPIO_INT_MASK,
-			    packet, GPIO_PAYLOAD_LEN(packet->num), NULL, NULL);
-	mutex_unlock(&ljca_gpio->trans_lock);
-	return ret;
+	ret = ljca_gpio_send_items(ljca_gpio,
+				   unmask ? GPIO_INT_UNMASK : GPIO_INT_MASK,
+				   mask, NULL, complete);
+	if (ret < 0)
+		return ret;
+
+	atomic_long_add(count, &ljca_gpio->irq_ops);
+	atomic_long_add(ret, &ljca_gpio->irq_xfers);
+	return 0;
 }
 
 static void ljca_gpio_async(struct work_struct *work)
 {
 	struct ljca_gpio_dev *ljca_gpio =
 		container_of(work, struct ljca_gpio_dev, work);
+	DECLARE_BITMAP(mask, MAX_GPIO_NUM) = {};
 	int gpio_id;
-	int unmasked;
+	int ret;
 
+	/* everything that fired since the last run goes out in one packet */
 	for_each_set_bit (gpio_id, ljca_gpio->reenable_irqs,
 			  ljca_gpio->gc.ngpio) {
-		clear_bit(gpio_id, ljca_gpio->reenable_irqs);
-		unmasked = test_bit(gpio_id, ljca_gpio->unmasked_irqs);
-		if (unmasked)
-			ljca_enable_irq(ljca_gpio, gpio_id, true);
+		if (test_and_clear_bit(gpio_id, ljca_gpio->reenable_irqs) &&
+		    test_bit(gpio_id, ljca_gpio->unmasked_irqs))
+			__set_bit(gpio_id, mask);
 	}
+
+	ret = ljca_gpio_irq_send(ljca_gpio, true, mask, ljca_gpio_irq_done);
+	if (ret)
+		dev_err(ljca_gpio->gc.parent, "irq re-enable failed %d\n", ret);
 }
 
 static void ljca_gpio_event_cb(struct platform_device *pdev, u8 cmd,
@@ -274,7 +557,8 @@ static void ljca_gpio_event_cb(struct platform_device *pdev, u8 cmd,
 			return;
 		}
 
-		generic_handle_irq(irq);
+		/* events come from a work, consumers get threaded handlers */
+		handle_nested_irq(irq);
 
 		set_bit(packet->item[i].index, ljca_gpio->reenable_irqs);
 		dev_dbg(ljca_gpio->gc.parent, "%s got one interrupt %d %d %d\n",
@@ -352,24 +636,27 @@ static void ljca_irq_bus_unlock(struct irq_data *irqd)
 {
 	struct gpio_chip *gc = irq_data_get_irq_chip_data(irqd);
 	struct ljca_gpio_dev *ljca_gpio = gpiochip_get_data(gc);
-	int gpio_id = irqd_to_hwirq(irqd);
-	int enabled;
-	int unmasked;
-
-	enabled = test_bit(gpio_id, ljca_gpio->enabled_irqs);
-	unmasked = test_bit(gpio_id, ljca_gpio->unmasked_irqs);
-	dev_dbg(ljca_gpio->gc.parent, "%s %d %d %d\n", __func__, gpio_id,
-		 enabled, unmasked);
-
-	if (enabled != unmasked) {
-		if (unmasked) {
-			gpio_config(ljca_gpio, gpio_id, 0);
-			ljca_enable_irq(ljca_gpio, gpio_id, true);
-			set_bit(gpio_id, ljca_gpio->enabled_irqs);
-		} else {
-			ljca_enable_irq(ljca_gpio, gpio_id, false);
-			clear_bit(gpio_id, ljca_gpio->enabled_irqs);
-		}
+	DECLARE_BITMAP(unmask, MAX_GPIO_NUM);
+	DECLARE_BITMAP(mask, MAX_GPIO_NUM);
+	int ngpio = ljca_gpio->gc.ngpio;
+
+	/* sync every pin whose state changed, not only the one of irqd */
+	bitmap_andnot(unmask, ljca_gpio->unmasked_irqs, ljca_gpio->enabled_irqs,
+		      ngpio);
+	bitmap_andnot(mask, ljca_gpio->enabled_irqs, ljca_gpio->unmasked_irqs,
+		      ngpio);
+
+	if (!bitmap_empty(unmask, ngpio)) {
+		gpio_config_multiple(ljca_gpio, unmask, 0);
+		ljca_gpio_irq_send(ljca_gpio, true, unmask, NULL);
+		bitmap_or(ljca_gpio->enabled_irqs, ljca_gpio->enabled_irqs,
+			  unmask, ngpio);
+	}
+
+	if (!bitmap_empty(mask, ngpio)) {
+		ljca_gpio_irq_send(ljca_gpio, false, mask, NULL);
+		bitmap_andnot(ljca_gpio->enabled_irqs, ljca_gpio->enabled_irqs,
+			      mask, ngpio);
 	}
 
 	mutex_unlock(&ljca_gpio->irq_lock);
@@ -389,6 +676,30 @@ static void ljca_irq_shutdown(struct irq_data *irqd)
 	gpiochip_unlock_as_irq(gc, irqd_to_hwirq(irqd));
 }
 
+static int irq_stats_show(struct seq_file *s, void *unused)
+{
+	struct ljca_gpio_dev *ljca_gpio = s->private;
+	long ops = atomic_long_read(&ljca_gpio->irq_ops);
+	long xfers = atomic_long_read(&ljca_gpio->irq_xfers);
+	long ratio = xfers ? ops * 100 / xfers : 0;
+
+	seq_printf(s, "ops: %ld transfers: %ld ops/transfer: %ld.%02ld\n", ops,
+		   xfers, ratio / 100, ratio % 100);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(irq_stats);
+
+static int cache_stats_show(struct seq_file *s, void *unused)
+{
+	struct ljca_gpio_dev *ljca_gpio = s->private;
+
+	seq_printf(s, "hits: %ld misses: %ld\n",
+		   atomic_long_read(&ljca_gpio->cache_hits),
+		   atomic_long_read(&ljca_gpio->cache_misses));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(cache_stats);
+
 static struct irq_chip ljca_gpio_irqchip = {
 	.name = "ljca-irq",
 	.irq_mask = ljca_irq_mask,
@@ -405,6 +716,7 @@ static int ljca_gpio_probe(struct platform_device *pdev)
 	struct ljca_gpio_dev *ljca_gpio;
 	struct ljca_platform_data *pdata = dev_get_platdata(&pdev->dev);
 	struct gpio_irq_chip *girq;
+	int ret;
 
 	ljca_gpio = devm_kzalloc(&pdev->dev, sizeof(*ljca_gpio), GFP_KERNEL);
 	if (!ljca_gpio)
@@ -419,11 +731,14 @@ static int ljca_gpio_probe(struct platform_device *pdev)
 
 	mutex_init(&ljca_gpio->irq_lock);
 	mutex_init(&ljca_gpio->trans_lock);
+	init_waitqueue_head(&ljca_gpio->async_wq);
 	ljca_gpio->pdev = pdev;
 	ljca_gpio->gc.direction_input = ljca_gpio_direction_input;
 	ljca_gpio->gc.direction_output = ljca_gpio_direction_output;
 	ljca_gpio->gc.get = ljca_gpio_get_value;
 	ljca_gpio->gc.set = ljca_gpio_set_value;
+	ljca_gpio->gc.get_multiple = ljca_gpio_get_multiple;
+	ljca_gpio->gc.set_multiple = ljca_gpio_set_multiple;
 	ljca_gpio->gc.set_config = ljca_gpio_set_config;
 	ljca_gpio->gc.can_sleep = true;
 	ljca_gpio->gc.parent = &pdev->dev;
@@ -445,13 +760,33 @@ static int ljca_gpio_probe(struct platform_device *pdev)
 	girq->parents = NULL;
 	girq->default_type = IRQ_TYPE_NONE;
 	girq->handler = handle_simple_irq;
+	girq->threaded = true;
 
 	INIT_WORK(&ljca_gpio->work, ljca_gpio_async);
-	return devm_gpiochip_add_data(&pdev->dev, &ljca_gpio->gc, ljca_gpio);
+	ret = devm_gpiochip_add_data(&pdev->dev, &ljca_gpio->gc, ljca_gpio);
+	if (ret)
+		return ret;
+
+	ljca_gpio->debugfs_dir = debugfs_create_dir(dev_name(&pdev->dev),
+						    ljca_debugfs_dir(pdev));
+	debugfs_create_file("irq_stats", 0444, ljca_gpio->debugfs_dir,
+			    ljca_gpio, &irq_stats_fops);
+	debugfs_create_file("cache_stats", 0444, ljca_gpio->debugfs_dir,
+			    ljca_gpio, &cache_stats_fops);
+	return 0;
 }
 
 static int ljca_gpio_remove(struct platform_device *pdev)
 {
+	struct ljca_gpio_dev *ljca_gpio = platform_get_drvdata(pdev);
+
+	/* no more events to schedule the re-enable work, then let it end */
+	ljca_unregister_event_cb(pdev);
+	cancel_work_sync(&ljca_gpio->work);
+	wait_event(ljca_gpio->async_wq,
+		   !atomic_read(&ljca_gpio->async_pending));
+
+	debugfs_remove_recursive(ljca_gpio->debugfs_dir);
 	return 0;
 }
 
@@ -6,10 +6,14 @@
  */
 
 #include <linux/acpi.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
 #include <linux/i2c.h>
+#include <linux/ktime.h>
 #include <linux/mfd/ljca.h>
 #include <linux/module.h>
 #include <linux/platform_device.h>
+#include <linux/seq_file.h>
 #include <linux/version.h>
 
 /* I2C commands */
@@ -69,17 +73,34 @@ struct i2c_rw_packet {
 	u8 data[];
 } __packed;
 
-#define LJCA_I2C_MAX_XFER_SIZE 256
-#define LJCA_I2C_BUF_SIZE                                                      \
-	(LJCA_I2C_MAX_XFER_SIZE + sizeof(struct i2c_rw_packet))
+/* ACKs of one command, longer messages are split over several */
+#define LJCA_I2C_BUF_SIZE 256
+
+/*
+ * A repeated START is an I2C_START sent while the bus is still held. The
+ * firmware interface does not say which versions accept that, so it can
+ * be turned off to close every message with a STOP instead.
+ */
+static bool repeated_start = true;
+module_param(repeated_start, bool, 0644);
+MODULE_PARM_DESC(repeated_start,
+		 "Join the messages of a transfer with repeated STARTs instead of STOP, START");
 
 struct ljca_i2c_dev {
 	struct platform_device *pdev;
 	struct ljca_i2c_info *ctr_info;
 	struct i2c_adapter adap;
 
-	u8 obuf[LJCA_I2C_BUF_SIZE];
+	/* payload bytes moved and time spent in ljca_i2c_xfer() */
+	u64 bytes_in;
+	u64 bytes_out;
+	u64 busy_ns;
+	struct dentry *debugfs_dir;
+
 	u8 ibuf[LJCA_I2C_BUF_SIZE];
+	/* WRITE payload and the ACKs of WRITE and STOP sent as one batch */
+	u8 batch_obuf[LJCA_I2C_BUF_SIZE];
+	u8 batch_ibuf[2][LJCA_I2C_BUF_SIZE];
 };
 
 static u8 ljca_i2c_format_slave_addr(u8 slave_addr, enum i2c_address_mode mode)
@@ -92,27 +113,36 @@ static u8 ljca_i2c_format_slave_addr(u8 slave_addr, enum i2c_address_mode mode)
 
 static int ljca_i2c_init(struct ljca_i2c_dev *ljca_i2c, u8 id)
 {
-	struct i2c_rw_packet *w_packet = (struct i2c_rw_packet *)ljca_i2c->obuf;
+	struct i2c_rw_packet *w_packet;
+
+	w_packet = ljca_get_tx_buf(ljca_i2c->pdev, NULL);
+	if (!w_packet)
+		return -ENODEV;
 
 	memset(w_packet, 0, sizeof(*w_packet));
 	w_packet->id = id;
 	w_packet->len = cpu_to_le16(1);
 	w_packet->data[0] = I2C_FLAG_FREQ_400K;
 
-	return ljca_transfer(ljca_i2c->pdev, I2C_INIT, w_packet,
-			     sizeof(*w_packet) + 1, NULL, NULL);
+	return ljca_transfer_tx_buf(ljca_i2c->pdev, I2C_INIT, w_packet,
+				    sizeof(*w_packet) + 1, NULL, NULL);
 }
 
 static int ljca_i2c_start(struct ljca_i2c_dev *ljca_i2c, u8 slave_addr,
 			  enum xfer_type type)
 {
-	struct i2c_rw_packet *w_packet = (struct i2c_rw_packet *)ljca_i2c->obuf;
+	struct i2c_rw_packet *w_packet;
 	struct i2c_rw_packet *r_packet = (struct i2c_rw_packet *)ljca_i2c->ibuf;
+	u8 id = ljca_i2c->ctr_info->id;
 	int ret;
 	int ibuf_len;
 
+	w_packet = ljca_get_tx_buf(ljca_i2c->pdev, NULL);
+	if (!w_packet)
+		return -ENODEV;
+
 	memset(w_packet, 0, sizeof(*w_packet));
-	w_packet->id = ljca_i2c->ctr_info->id;
+	w_packet->id = id;
 	w_packet->len = cpu_to_le16(1);
 	w_packet->data[0] =
 		ljca_i2c_format_slave_addr(slave_addr, I2C_ADDRESS_MODE_7BIT);
@@ -120,18 +150,16 @@ static int ljca_i2c_start(struct ljca_i2c_dev *ljca_i2c, u8 slave_addr,
 					   I2C_SLAVE_TRANSFER_READ :
 					   I2C_SLAVE_TRANSFER_WRITE;
 
-	ret = ljca_transfer(ljca_i2c->pdev, I2C_START, w_packet,
-			    sizeof(*w_packet) + 1, r_packet, &ibuf_len);
+	ret = ljca_transfer_tx_buf(ljca_i2c->pdev, I2C_START, w_packet,
+				   sizeof(*w_packet) + 1, r_packet, &ibuf_len);
 
 	if (ret || ibuf_len < sizeof(*r_packet))
 		return -EIO;
 
-	if ((s16)le16_to_cpu(r_packet->len) < 0 ||
-	    r_packet->id != w_packet->id) {
+	if ((s16)le16_to_cpu(r_packet->len) < 0 || r_packet->id != id) {
 		dev_err(&ljca_i2c->adap.dev,
 			"i2c start failed len:%d id:%d %d\n",
-			(s16)le16_to_cpu(r_packet->len), r_packet->id,
-			w_packet->id);
+			(s16)le16_to_cpu(r_packet->len), r_packet->id, id);
 		return -EIO;
 	}
 
@@ -140,172 +168,323 @@ static int ljca_i2c_start(struct ljca_i2c_dev *ljca_i2c, u8 slave_addr,
 
 static int ljca_i2c_stop(struct ljca_i2c_dev *ljca_i2c, u8 slave_addr)
 {
-	struct i2c_rw_packet *w_packet = (struct i2c_rw_packet *)ljca_i2c->obuf;
+	struct i2c_rw_packet *w_packet;
 	struct i2c_rw_packet *r_packet = (struct i2c_rw_packet *)ljca_i2c->ibuf;
+	u8 id = ljca_i2c->ctr_info->id;
 	int ret;
 	int ibuf_len;
 
+	w_packet = ljca_get_tx_buf(ljca_i2c->pdev, NULL);
+	if (!w_packet)
+		return -ENODEV;
+
 	memset(w_packet, 0, sizeof(*w_packet));
-	w_packet->id = ljca_i2c->ctr_info->id;
+	w_packet->id = id;
 	w_packet->len = cpu_to_le16(1);
 	w_packet->data[0] = 0;
 
-	ret = ljca_transfer(ljca_i2c->pdev, I2C_STOP, w_packet,
-			    sizeof(*w_packet) + 1, r_packet, &ibuf_len);
+	ret = ljca_transfer_tx_buf(ljca_i2c->pdev, I2C_STOP, w_packet,
+				   sizeof(*w_packet) + 1, r_packet, &ibuf_len);
 
 	if (ret || ibuf_len < sizeof(*r_packet))
 		return -EIO;
 
-	if ((s16)le16_to_cpu(r_packet->len) < 0 ||
-	    r_packet->id != w_packet->id) {
+	if ((s16)le16_to_cpu(r_packet->len) < 0 || r_packet->id != id) {
 		dev_err(&ljca_i2c->adap.dev,
 			"i2c stop failed len:%d id:%d %d\n",
-			(s16)le16_to_cpu(r_packet->len), r_packet->id,
-			w_packet->id);
+			(s16)le16_to_cpu(r_packet->len), r_packet->id, id);
 		return -EIO;
 	}
 
 	return 0;
 }
 
-static int ljca_i2c_pure_read(struct ljca_i2c_dev *ljca_i2c, u8 *data, int len)
+/* read one chunk that fits a single I2C_READ and its ACK */
+static int ljca_i2c_read_chunk(struct ljca_i2c_dev *ljca_i2c, u8 *data,
+			       int len, int *done)
 {
-	struct i2c_rw_packet *w_packet = (struct i2c_rw_packet *)ljca_i2c->obuf;
+	struct i2c_rw_packet *w_packet;
 	struct i2c_rw_packet *r_packet = (struct i2c_rw_packet *)ljca_i2c->ibuf;
+	u8 id = ljca_i2c->ctr_info->id;
 	int ibuf_len;
+	int buf_len;
 	int ret;
 
-	if (len > LJCA_I2C_MAX_XFER_SIZE)
-		return -EINVAL;
+	w_packet = ljca_get_tx_buf(ljca_i2c->pdev, &buf_len);
+	if (!w_packet)
+		return -ENODEV;
 
+	len = min_t(int, len, buf_len - sizeof(*w_packet));
 	memset(w_packet, 0, sizeof(*w_packet));
-	w_packet->id = ljca_i2c->ctr_info->id;
+	w_packet->id = id;
 	w_packet->len = cpu_to_le16(len);
-	ret = ljca_transfer(ljca_i2c->pdev, I2C_READ, w_packet,
-			    sizeof(*w_packet) + 1, r_packet, &ibuf_len);
+	ret = ljca_transfer_tx_buf(ljca_i2c->pdev, I2C_READ, w_packet,
+				   sizeof(*w_packet) + 1, r_packet, &ibuf_len);
 	if (ret) {
 		dev_err(&ljca_i2c->adap.dev, "I2C_READ failed ret:%d\n", ret);
 		return ret;
 	}
 
-	if (ibuf_len < sizeof(*r_packet))
+	if (ibuf_len < sizeof(*r_packet) + len)
 		return -EIO;
 
-	if ((s16)le16_to_cpu(r_packet->len) != len ||
-	    r_packet->id != w_packet->id) {
+	if ((s16)le16_to_cpu(r_packet->len) != len || r_packet->id != id) {
 		dev_err(&ljca_i2c->adap.dev,
 			"i2c raw read failed len:%d id:%d %d\n",
-			(s16)le16_to_cpu(r_packet->len), r_packet->id,
-			w_packet->id);
+			(s16)le16_to_cpu(r_packet->len), r_packet->id, id);
 		return -EIO;
 	}
 
 	memcpy(data, r_packet->data, len);
+	*done = len;
 
 	return 0;
 }
 
-static int ljca_i2c_read(struct ljca_i2c_dev *ljca_i2c, u8 slave_addr, u8 *data,
-			 u8 len)
+/* read len bytes as back to back I2C_READs between one START and STOP */
+static int ljca_i2c_pure_read(struct ljca_i2c_dev *ljca_i2c, u8 *data, int len)
 {
+	int offset;
+	int done;
 	int ret;
 
-	ret = ljca_i2c_start(ljca_i2c, slave_addr, READ_XFER_TYPE);
-	if (ret)
-		return ret;
-
-	ret = ljca_i2c_pure_read(ljca_i2c, data, len);
-	if (ret) {
-		dev_err(&ljca_i2c->adap.dev, "i2c raw read failed ret:%d\n",
-			ret);
-
-		return ret;
+	for (offset = 0; offset < len; offset += done) {
+		ret = ljca_i2c_read_chunk(ljca_i2c, data + offset, len - offset,
+					  &done);
+		if (ret)
+			return ret;
 	}
 
-	return ljca_i2c_stop(ljca_i2c, slave_addr);
+	ljca_i2c->bytes_in += len;
+	return 0;
 }
 
-static int ljca_i2c_pure_write(struct ljca_i2c_dev *ljca_i2c, u8 *data, u8 len)
+static int ljca_i2c_write_chunk(struct ljca_i2c_dev *ljca_i2c, const u8 *data,
+				int len, int *done)
 {
-	struct i2c_rw_packet *w_packet = (struct i2c_rw_packet *)ljca_i2c->obuf;
+	struct i2c_rw_packet *w_packet;
 	struct i2c_rw_packet *r_packet = (struct i2c_rw_packet *)ljca_i2c->ibuf;
+	u8 id = ljca_i2c->ctr_info->id;
 	int ret;
 	int ibuf_len;
+	int buf_len;
 
-	if (len > LJCA_I2C_MAX_XFER_SIZE)
-		return -EINVAL;
+	w_packet = ljca_get_tx_buf(ljca_i2c->pdev, &buf_len);
+	if (!w_packet)
+		return -ENODEV;
 
+	len = min_t(int, len, buf_len - sizeof(*w_packet));
 	memset(w_packet, 0, sizeof(*w_packet));
-	w_packet->id = ljca_i2c->ctr_info->id;
+	w_packet->id = id;
 	w_packet->len = cpu_to_le16(len);
 	memcpy(w_packet->data, data, len);
 
-	ret = ljca_transfer(ljca_i2c->pdev, I2C_WRITE, w_packet,
-			    sizeof(*w_packet) + w_packet->len, r_packet,
-			    &ibuf_len);
+	ret = ljca_transfer_tx_buf(ljca_i2c->pdev, I2C_WRITE, w_packet,
+				   sizeof(*w_packet) + len, r_packet,
+				   &ibuf_len);
 
 	if (ret || ibuf_len < sizeof(*r_packet))
 		return -EIO;
 
-	if ((s16)le16_to_cpu(r_packet->len) != len ||
-	    r_packet->id != w_packet->id) {
+	if ((s16)le16_to_cpu(r_packet->len) != len || r_packet->id != id) {
 		dev_err(&ljca_i2c->adap.dev,
 			"i2c write failed len:%d id:%d/%d\n",
-			(s16)le16_to_cpu(r_packet->len), r_packet->id,
-			w_packet->id);
+			(s16)le16_to_cpu(r_packet->len), r_packet->id, id);
 		return -EIO;
 	}
 
+	*done = len;
 	return 0;
 }
 
-static int ljca_i2c_write(struct ljca_i2c_dev *ljca_i2c, u8 slave_addr,
-			  u8 *data, u8 len)
+static int ljca_i2c_pure_write(struct ljca_i2c_dev *ljca_i2c, const u8 *data,
+			       int len)
 {
+	int offset = 0;
+	int done;
 	int ret;
 
-	if (!data)
-		return -EINVAL;
+	/* a zero-length write still goes out, for SMBus quick commands */
+	do {
+		ret = ljca_i2c_write_chunk(ljca_i2c, data + offset,
+					   len - offset, &done);
+		if (ret)
+			return ret;
+
+		offset += done;
+	} while (offset < len);
+
+	ljca_i2c->bytes_out += len;
+	return 0;
+}
+
+static void ljca_i2c_batch_done(void *context, int status)
+{
+	complete(context);
+}
+
+/* whether an ACK is good, len < 0 accepts any non-negative length */
+static bool ljca_i2c_ack_ok(struct ljca_i2c_dev *ljca_i2c,
+			    struct ljca_xfer *xfer, int len)
+{
+	struct i2c_rw_packet *r_packet = xfer->ibuf;
+	s16 r_len;
+
+	if (xfer->status || xfer->ibuf_len < sizeof(*r_packet))
+		return false;
 
-	ret = ljca_i2c_start(ljca_i2c, slave_addr, WRITE_XFER_TYPE);
+	r_len = le16_to_cpu(r_packet->len);
+	if (r_packet->id != ljca_i2c->ctr_info->id || r_len < 0 ||
+	    (len >= 0 && r_len != len)) {
+		dev_err(&ljca_i2c->adap.dev,
+			"i2c cmd %d failed len:%d id:%d %d\n", xfer->cmd, r_len,
+			r_packet->id, ljca_i2c->ctr_info->id);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * A lone write that fits one command goes out as START and, once the
+ * address was ACKed, a WRITE, STOP batch the bridge may pack into a single
+ * bulk transfer. The adapter lock serializes the batch buffers.
+ */
+static int ljca_i2c_write_batched(struct ljca_i2c_dev *ljca_i2c,
+				  struct i2c_msg *msg)
+{
+	u8 stop_buf[sizeof(struct i2c_rw_packet) + 1];
+	struct i2c_rw_packet *packet;
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct ljca_xfer xfers[2] = {
+		{ I2C_WRITE, ljca_i2c->batch_obuf, sizeof(*packet) + msg->len,
+		  ljca_i2c->batch_ibuf[0] },
+		{ I2C_STOP, stop_buf, sizeof(stop_buf),
+		  ljca_i2c->batch_ibuf[1] },
+	};
+	u8 id = ljca_i2c->ctr_info->id;
+	int ret;
+
+	ret = ljca_i2c_start(ljca_i2c, msg->addr, WRITE_XFER_TYPE);
 	if (ret)
-		return ret;
+		goto stop;
+
+	packet = (struct i2c_rw_packet *)ljca_i2c->batch_obuf;
+	packet->id = id;
+	packet->len = cpu_to_le16(msg->len);
+	memcpy(packet->data, msg->buf, msg->len);
 
-	ret = ljca_i2c_pure_write(ljca_i2c, data, len);
+	packet = (struct i2c_rw_packet *)stop_buf;
+	packet->id = id;
+	packet->len = cpu_to_le16(1);
+	packet->data[0] = 0;
+
+	ret = ljca_transfer_batch(ljca_i2c->pdev, xfers, ARRAY_SIZE(xfers),
+				  ljca_i2c_batch_done, &done);
 	if (ret)
-		return ret;
+		goto stop;
+
+	wait_for_completion(&done);
+
+	/* a STOP that failed or was never sent leaves the bus held */
+	if (!ljca_i2c_ack_ok(ljca_i2c, &xfers[1], -1)) {
+		ret = -EIO;
+		goto stop;
+	}
+
+	if (!ljca_i2c_ack_ok(ljca_i2c, &xfers[0], msg->len))
+		return -EIO;
+
+	ljca_i2c->bytes_out += msg->len;
+	return 0;
 
-	return ljca_i2c_stop(ljca_i2c, slave_addr);
+stop:
+	ljca_i2c_stop(ljca_i2c, msg->addr);
+	return ret;
 }
 
-static int ljca_i2c_xfer(struct i2c_adapter *adapter, struct i2c_msg *msg,
-			 int num)
+/*
+ * The messages of one transfer form a single transaction: each opens with a
+ * (repeated) START and only the last is followed by STOP. A register read,
+ * write then read, thus takes START, WRITE, START, READ, STOP. Without
+ * repeated_start a STOP goes between the messages too.
+ */
+static int ljca_i2c_xfer_msgs(struct ljca_i2c_dev *ljca_i2c,
+			      struct i2c_adapter *adapter, struct i2c_msg *msg,
+			      int num)
 {
-	struct ljca_i2c_dev *ljca_i2c;
 	struct i2c_msg *cur_msg;
+	u64 start = ktime_get_ns();
 	int i, ret;
 
-	ljca_i2c = i2c_get_adapdata(adapter);
-	if (!ljca_i2c)
-		return -EINVAL;
+	if (num == 1 && !(msg->flags & I2C_M_RD) &&
+	    sizeof(struct i2c_rw_packet) + msg->len <=
+		    ljca_max_payload(ljca_i2c->pdev)) {
+		ret = ljca_i2c_write_batched(ljca_i2c, msg);
+		ljca_i2c->busy_ns += ktime_get_ns() - start;
+		return ret ? ret : num;
+	}
 
 	for (i = 0; i < num; i++) {
 		cur_msg = &msg[i];
 		dev_dbg(&adapter->dev, "i:%d msg:(%d %d)\n", i, cur_msg->flags,
 			cur_msg->len);
-		if (cur_msg->flags & I2C_M_RD)
-			ret = ljca_i2c_read(ljca_i2c, cur_msg->addr,
-					    cur_msg->buf, cur_msg->len);
-
-		else
-			ret = ljca_i2c_write(ljca_i2c, cur_msg->addr,
-					     cur_msg->buf, cur_msg->len);
+		if (i && !READ_ONCE(repeated_start)) {
+			ret = ljca_i2c_stop(ljca_i2c, msg[i - 1].addr);
+			if (ret)
+				goto stop;
+		}
 
+		ret = ljca_i2c_start(ljca_i2c, cur_msg->addr,
+				     (cur_msg->flags & I2C_M_RD) ?
+					     READ_XFER_TYPE :
+					     WRITE_XFER_TYPE);
 		if (ret)
-			return ret;
+			goto stop;
+
+		if (cur_msg->flags & I2C_M_RD)
+			ret = ljca_i2c_pure_read(ljca_i2c, cur_msg->buf,
+						 cur_msg->len);
+		else
+			ret = ljca_i2c_pure_write(ljca_i2c, cur_msg->buf,
+						  cur_msg->len);
+		if (ret) {
+			dev_err(&adapter->dev, "i2c %s failed ret:%d\n",
+				(cur_msg->flags & I2C_M_RD) ? "read" : "write",
+				ret);
+			goto stop;
+		}
 	}
 
-	return num;
+	ret = ljca_i2c_stop(ljca_i2c, msg[num - 1].addr);
+	ljca_i2c->busy_ns += ktime_get_ns() - start;
+	return ret ? ret : num;
+
+stop:
+	/* release the bus, the transfer failed either way */
+	ljca_i2c_stop(ljca_i2c, cur_msg->addr);
+	ljca_i2c->busy_ns += ktime_get_ns() - start;
+	return ret;
+}
+
+static int ljca_i2c_xfer(struct i2c_adapter *adapter, struct i2c_msg *msg,
+			 int num)
+{
+	struct ljca_i2c_dev *ljca_i2c;
+	int ret;
+
+	ljca_i2c = i2c_get_adapdata(adapter);
+	if (!ljca_i2c)
+		return -EINVAL;
+
+	/* keep the bridge awake from START to STOP */
+	ret = ljca_pm_get(ljca_i2c->pdev);
+	if (ret)
+		return ret;
+
+	ret = ljca_i2c_xfer_msgs(ljca_i2c, adapter, msg, num);
+	ljca_pm_put(ljca_i2c->pdev);
+	return ret;
 }
 
 static u32 ljca_i2c_func(struct i2c_adapter *adap)
@@ -313,10 +492,25 @@ static u32 ljca_i2c_func(struct i2c_adapter *adap)
 	return I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL;
 }
 
-static const struct i2c_adapter_quirks ljca_i2c_quirks = {
-	.max_read_len = LJCA_I2C_MAX_XFER_SIZE,
-	.max_write_len = LJCA_I2C_MAX_XFER_SIZE,
-};
+/* ljca_i2c_xfer() runs under the adapter's bus lock, so do the counters */
+static int stats_show(struct seq_file *s, void *unused)
+{
+	struct ljca_i2c_dev *ljca_i2c = s->private;
+	u64 bytes, busy_ns;
+
+	i2c_lock_bus(&ljca_i2c->adap, I2C_LOCK_ROOT_ADAPTER);
+	bytes = ljca_i2c->bytes_in + ljca_i2c->bytes_out;
+	busy_ns = ljca_i2c->busy_ns;
+	seq_printf(s, "bytes_in: %llu bytes_out: %llu busy_us: %llu\n",
+		   ljca_i2c->bytes_in, ljca_i2c->bytes_out,
+		   div_u64(busy_ns, NSEC_PER_USEC));
+	i2c_unlock_bus(&ljca_i2c->adap, I2C_LOCK_ROOT_ADAPTER);
+
+	seq_printf(s, "throughput(B/s): %llu\n",
+		   busy_ns ? div64_u64(bytes * NSEC_PER_SEC, busy_ns) : 0);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
 
 static const struct i2c_algorithm ljca_i2c_algo = {
 	.master_xfer = ljca_i2c_xfer,
@@ -431,6 +625,11 @@ static int ljca_i2c_probe(struct platform_device *pdev)
 	if (ret)
 		return ret;
 
+	ljca_i2c->debugfs_dir = debugfs_create_dir(dev_name(&pdev->dev),
+						   ljca_debugfs_dir(pdev));
+	debugfs_create_file("stats", 0444, ljca_i2c->debugfs_dir, ljca_i2c,
+			    &stats_fops);
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
 	if (has_acpi_companion(&ljca_i2c->adap.dev))
 		acpi_dev_clear_dependencies(ACPI_COMPANION(&ljca_i2c->adap.dev));
@@ -443,6 +642,7 @@ static int ljca_i2c_remove(struct platform_device *pdev)
 {
 	struct ljca_i2c_dev *ljca_i2c = platform_get_drvdata(pdev);
 
+	debugfs_remove_recursive(ljca_i2c->debugfs_dir);
 	i2c_del_adapter(&ljca_i2c->adap);
 
 	return 0;
@@ -0,0 +1,569 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KUnit tests of the LJCA command path, run against a fake transport.
+ * Included by ljca.c to reach its internals.
+ *
+ * Copyright (c) 2021, Intel Corporation.
+ */
+
+#include <kunit/test.h>
+
+#define LJCA_TEST_FRAMES 16
+#define LJCA_TEST_CMDS 4
+#define LJCA_TEST_BENCH_ROUNDS 10000
+
+struct ljca_test_worker;
+
+struct ljca_test {
+	/* the fake bridge finds its test through ljca->intf */
+	struct usb_interface intf;
+	struct ljca_dev *ljca;
+	struct platform_device pdev;
+	struct ljca_platform_data pdata;
+
+	/* the transfers handed to the transport, in order */
+	spinlock_t lock;
+	u8 frames[LJCA_TEST_FRAMES][LJCA_MAX_FRAME_SIZE];
+	int frame_len[LJCA_TEST_FRAMES];
+	int frame_count;
+	wait_queue_head_t sent_wq;
+	atomic_t pm_refs;
+
+	u8 ibuf[LJCA_TEST_CMDS][LJCA_MAX_FRAME_SIZE];
+
+	/* children blocked in works, flushed once the bridge halted */
+	struct ljca_test_worker *workers;
+	int worker_count;
+};
+
+static struct ljca_test *ljca_test_from(struct ljca_dev *ljca)
+{
+	return container_of(ljca->intf, struct ljca_test, intf);
+}
+
+/* record the transfer and have it written at once */
+static int ljca_test_send(struct ljca_tx_buf *tx)
+{
+	struct ljca_test *t = ljca_test_from(tx->ljca);
+	unsigned long flags;
+
+	spin_lock_irqsave(&t->lock, flags);
+	if (t->frame_count == LJCA_TEST_FRAMES) {
+		spin_unlock_irqrestore(&t->lock, flags);
+		return -ENOSPC;
+	}
+
+	memcpy(t->frames[t->frame_count], tx->buf, tx->len);
+	t->frame_len[t->frame_count++] = tx->len;
+	spin_unlock_irqrestore(&t->lock, flags);
+	wake_up(&t->sent_wq);
+
+	ljca_write_done(tx, 0);
+	return 0;
+}
+
+static void ljca_test_cancel(struct ljca_tx_buf *tx)
+{
+}
+
+static int ljca_test_pm_get(struct ljca_dev *ljca)
+{
+	atomic_inc(&ljca_test_from(ljca)->pm_refs);
+	return 0;
+}
+
+static void ljca_test_pm_put(struct ljca_dev *ljca)
+{
+	atomic_dec(&ljca_test_from(ljca)->pm_refs);
+}
+
+static const struct ljca_transport_ops ljca_test_ops = {
+	.send = ljca_test_send,
+	.cancel = ljca_test_cancel,
+	.pm_get = ljca_test_pm_get,
+	.pm_put = ljca_test_pm_put,
+};
+
+/* the n-th message sent, looking into packed transfers too */
+static struct ljca_msg *ljca_test_msg(struct ljca_test *t, int n)
+{
+	struct ljca_msg *msg;
+	int offset;
+	int i;
+
+	for (i = 0; i < t->frame_count; i++) {
+		for (offset = 0; offset < t->frame_len[i];
+		     offset += sizeof(*msg) + msg->len) {
+			msg = (struct ljca_msg *)(t->frames[i] + offset);
+			if (!n--)
+				return msg;
+		}
+	}
+
+	return NULL;
+}
+
+/* have the bridge ACK a command of a stub */
+static void ljca_test_ack_type(struct ljca_test *t, u8 type, u8 cmd,
+			       const void *data, int len)
+{
+	u8 buf[LJCA_MAX_FRAME_SIZE];
+	struct ljca_msg *msg = (struct ljca_msg *)buf;
+
+	msg->type = type;
+	msg->cmd = cmd;
+	msg->flags = ACK_FLAG | CMPL_FLAG;
+	msg->len = len;
+	memcpy(msg->data, data, len);
+
+	rcu_read_lock();
+	ljca_rx_msgs(t->ljca, buf, sizeof(*msg) + len, ktime_get_ns());
+	rcu_read_unlock();
+}
+
+static void ljca_test_ack(struct ljca_test *t, u8 cmd, const void *data,
+			  int len)
+{
+	ljca_test_ack_type(t, t->pdata.type, cmd, data, len);
+}
+
+struct ljca_test_cmd {
+	int calls;
+	int status;
+	int ibuf_len;
+};
+
+static void ljca_test_cmd_done(void *context, int status, int ibuf_len)
+{
+	struct ljca_test_cmd *c = context;
+
+	c->calls++;
+	c->status = status;
+	c->ibuf_len = ibuf_len;
+}
+
+struct ljca_test_batch {
+	int calls;
+	int status;
+};
+
+static void ljca_test_batch_done(void *context, int status)
+{
+	struct ljca_test_batch *b = context;
+
+	b->calls++;
+	b->status = status;
+}
+
+static void ljca_test_async_complete(struct kunit *test)
+{
+	struct ljca_test *t = test->priv;
+	const u8 obuf[] = { 1, 2, 3 };
+	const u8 ack[] = { 0xa, 0xb };
+	struct ljca_test_cmd c = {};
+	struct ljca_msg *msg;
+	int ret;
+
+	ret = ljca_transfer_async(&t->pdev, 7, obuf, sizeof(obuf), t->ibuf[0],
+				  ljca_test_cmd_done, &c);
+	KUNIT_ASSERT_EQ(test, ret, 0);
+	KUNIT_EXPECT_EQ(test, c.calls, 0);
+
+	msg = ljca_test_msg(t, 0);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, msg);
+	KUNIT_EXPECT_EQ(test, msg->type, t->pdata.type);
+	KUNIT_EXPECT_EQ(test, msg->cmd, 7);
+	KUNIT_EXPECT_EQ(test, msg->flags, ACK_FLAG | CMPL_FLAG);
+	KUNIT_EXPECT_EQ(test, msg->len, sizeof(obuf));
+	KUNIT_EXPECT_EQ(test, memcmp(msg->data, obuf, sizeof(obuf)), 0);
+
+	ljca_test_ack(t, 7, ack, sizeof(ack));
+	KUNIT_EXPECT_EQ(test, c.calls, 1);
+	KUNIT_EXPECT_EQ(test, c.status, 0);
+	KUNIT_EXPECT_EQ(test, c.ibuf_len, sizeof(ack));
+	KUNIT_EXPECT_EQ(test, memcmp(t->ibuf[0], ack, sizeof(ack)), 0);
+	KUNIT_EXPECT_EQ(test, atomic_read(&t->pm_refs), 0);
+
+	/* the command ended, a second ACK finds nothing to complete */
+	ljca_test_ack(t, 7, ack, sizeof(ack));
+	KUNIT_EXPECT_EQ(test, c.calls, 1);
+}
+
+/* a command that can't be queued fails the rest, those before it still end */
+static void ljca_test_batch_partial_failure(struct kunit *test)
+{
+	struct ljca_test *t = test->priv;
+	bool pack = tx_pack;
+	u8 big[LJCA_MAX_FRAME_SIZE + 1] = {};
+	const u8 obuf[] = { 1, 2 };
+	const u8 ack[] = { 3 };
+	struct ljca_test_batch b;
+	struct ljca_xfer xfers[3];
+	int sent = 0;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		tx_pack = i;
+		memset(&b, 0, sizeof(b));
+		memset(xfers, 0, sizeof(xfers));
+		xfers[0] = (struct ljca_xfer){ 1, obuf, sizeof(obuf),
+					       t->ibuf[0] };
+		xfers[1] = (struct ljca_xfer){ 2, big,
+					       t->ljca->max_payload + 1,
+					       t->ibuf[1] };
+		xfers[2] = (struct ljca_xfer){ 3, obuf, sizeof(obuf),
+					       t->ibuf[2] };
+
+		KUNIT_ASSERT_EQ(test,
+				ljca_transfer_batch(&t->pdev, xfers,
+						    ARRAY_SIZE(xfers),
+						    ljca_test_batch_done, &b),
+				0);
+		KUNIT_EXPECT_EQ(test, b.calls, 0);
+		KUNIT_EXPECT_EQ(test, xfers[1].status, -EINVAL);
+		KUNIT_EXPECT_EQ(test, xfers[2].status, -EINVAL);
+
+		/* only the first one went out */
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ljca_test_msg(t, sent));
+		KUNIT_EXPECT_EQ(test, ljca_test_msg(t, sent)->cmd, 1);
+		sent++;
+		KUNIT_EXPECT_TRUE(test, !ljca_test_msg(t, sent));
+
+		ljca_test_ack(t, 1, ack, sizeof(ack));
+		KUNIT_EXPECT_EQ(test, b.calls, 1);
+		KUNIT_EXPECT_EQ(test, b.status, -EINVAL);
+		KUNIT_EXPECT_EQ(test, xfers[0].status, 0);
+		KUNIT_EXPECT_EQ(test, xfers[0].ibuf_len, sizeof(ack));
+		KUNIT_EXPECT_EQ(test, t->ibuf[0][0], ack[0]);
+	}
+
+	tx_pack = pack;
+	KUNIT_EXPECT_EQ(test, atomic_read(&t->pm_refs), 0);
+}
+
+/* commands go out in the order queued and each takes its own ACK */
+static void ljca_test_ordering(struct kunit *test)
+{
+	struct ljca_test *t = test->priv;
+	struct ljca_xfer xfers[LJCA_TEST_CMDS];
+	u8 obuf[LJCA_TEST_CMDS];
+	bool pack = tx_pack;
+	struct ljca_test_batch b;
+	struct ljca_msg *msg;
+	int frames;
+	int sent = 0;
+	int i, j;
+	u8 ack;
+
+	for (i = 0; i < 2; i++) {
+		tx_pack = i;
+		memset(&b, 0, sizeof(b));
+		frames = t->frame_count;
+		for (j = 0; j < LJCA_TEST_CMDS; j++) {
+			obuf[j] = j;
+			xfers[j] = (struct ljca_xfer){ 5, &obuf[j], 1,
+						       t->ibuf[j] };
+		}
+
+		KUNIT_ASSERT_EQ(test,
+				ljca_transfer_batch(&t->pdev, xfers,
+						    LJCA_TEST_CMDS,
+						    ljca_test_batch_done, &b),
+				0);
+		/* packed they share one transfer */
+		KUNIT_EXPECT_EQ(test, t->frame_count - frames,
+				tx_pack ? 1 : LJCA_TEST_CMDS);
+
+		for (j = 0; j < LJCA_TEST_CMDS; j++) {
+			msg = ljca_test_msg(t, sent + j);
+			KUNIT_ASSERT_NOT_ERR_OR_NULL(test, msg);
+			KUNIT_EXPECT_EQ(test, msg->data[0], j);
+		}
+		sent += LJCA_TEST_CMDS;
+
+		for (j = 0; j < LJCA_TEST_CMDS; j++) {
+			KUNIT_EXPECT_EQ(test, b.calls, 0);
+			ack = 0x80 | j;
+			ljca_test_ack(t, 5, &ack, 1);
+		}
+
+		KUNIT_EXPECT_EQ(test, b.calls, 1);
+		KUNIT_EXPECT_EQ(test, b.status, 0);
+		for (j = 0; j < LJCA_TEST_CMDS; j++)
+			KUNIT_EXPECT_EQ(test, t->ibuf[j][0], 0x80 | j);
+	}
+
+	tx_pack = pack;
+	KUNIT_EXPECT_EQ(test, atomic_read(&t->pm_refs), 0);
+}
+
+/* a child waiting in ljca_transfer() from a work of its own */
+struct ljca_test_worker {
+	struct work_struct work;
+	struct platform_device pdev;
+	struct ljca_platform_data pdata;
+	u8 cmd;
+	u8 ibuf[LJCA_MAX_FRAME_SIZE];
+	int ibuf_len;
+	int ret;
+	struct completion done;
+};
+
+static void ljca_test_worker_fn(struct work_struct *work)
+{
+	struct ljca_test_worker *w =
+		container_of(work, struct ljca_test_worker, work);
+
+	w->ret = ljca_transfer(&w->pdev, w->cmd, &w->cmd, 1, w->ibuf,
+			       &w->ibuf_len);
+	complete(&w->done);
+}
+
+static void ljca_test_worker_start(struct ljca_test *t,
+				   struct ljca_test_worker *w, int type, u8 cmd)
+{
+	w->pdata.ljca = t->ljca;
+	w->pdata.type = type;
+	w->pdev.dev.platform_data = &w->pdata;
+	w->cmd = cmd;
+	init_completion(&w->done);
+	INIT_WORK(&w->work, ljca_test_worker_fn);
+	t->worker_count++;
+	queue_work(system_unbound_wq, &w->work);
+}
+
+/*
+ * Commands of different stubs are on the wire together and may be ACKed
+ * in any order, those of one stub wait for the one before to end.
+ */
+static void ljca_test_concurrency(struct kunit *test)
+{
+	struct ljca_test *t = test->priv;
+	struct ljca_test_worker *w;
+	struct ljca_msg *msg;
+	u8 ack;
+	int i;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test,
+				     ljca_stub_alloc(t->ljca, SPI_STUB, 0));
+
+	w = kunit_kcalloc(test, 3, sizeof(*w), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, w);
+	t->workers = w;
+
+	ljca_test_worker_start(t, &w[0], I2C_STUB, 1);
+	ljca_test_worker_start(t, &w[1], SPI_STUB, 2);
+	KUNIT_ASSERT_TRUE(test, wait_event_timeout(t->sent_wq,
+						   READ_ONCE(t->frame_count) >=
+							   2,
+						   HZ));
+
+	/* the second I2C command waits for the first one's ACK */
+	ljca_test_worker_start(t, &w[2], I2C_STUB, 3);
+	KUNIT_EXPECT_FALSE(test, wait_event_timeout(t->sent_wq,
+						    READ_ONCE(t->frame_count) >
+							    2,
+						    HZ / 10));
+	KUNIT_EXPECT_FALSE(test, completion_done(&w[0].done));
+	KUNIT_EXPECT_FALSE(test, completion_done(&w[1].done));
+
+	/* answered the other way round, each takes its own ACK */
+	ack = 0x80 | 2;
+	ljca_test_ack_type(t, SPI_STUB, 2, &ack, 1);
+	KUNIT_EXPECT_TRUE(test, wait_for_completion_timeout(&w[1].done, HZ));
+	KUNIT_EXPECT_FALSE(test, completion_done(&w[0].done));
+
+	ack = 0x80 | 1;
+	ljca_test_ack_type(t, I2C_STUB, 1, &ack, 1);
+	KUNIT_EXPECT_TRUE(test, wait_for_completion_timeout(&w[0].done, HZ));
+
+	KUNIT_ASSERT_TRUE(test, wait_event_timeout(t->sent_wq,
+						   READ_ONCE(t->frame_count) >=
+							   3,
+						   HZ));
+	msg = ljca_test_msg(t, 2);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, msg);
+	KUNIT_EXPECT_EQ(test, msg->type, I2C_STUB);
+	KUNIT_EXPECT_EQ(test, msg->cmd, 3);
+
+	ack = 0x80 | 3;
+	ljca_test_ack_type(t, I2C_STUB, 3, &ack, 1);
+	KUNIT_EXPECT_TRUE(test, wait_for_completion_timeout(&w[2].done, HZ));
+
+	for (i = 0; i < 3; i++) {
+		flush_work(&w[i].work);
+		KUNIT_EXPECT_EQ(test, w[i].ret, 0);
+		KUNIT_EXPECT_EQ(test, w[i].ibuf_len, 1);
+		KUNIT_EXPECT_EQ(test, w[i].ibuf[0], 0x80 | w[i].cmd);
+	}
+	KUNIT_EXPECT_EQ(test, atomic_read(&t->pm_refs), 0);
+}
+
+/*
+ * Replay a captured burst, an ACK for each child stub and a GPIO event,
+ * through the receive path and time its dispatch. The commands the ACKs
+ * answer are queued before the clock starts.
+ */
+static void ljca_test_dispatch_bench(struct kunit *test)
+{
+	static const u8 types[] = { GPIO_STUB, I2C_STUB, SPI_STUB };
+	struct ljca_test_cmd c[ARRAY_SIZE(types)] = {};
+	struct ljca_stub *stubs[ARRAY_SIZE(types)];
+	struct ljca_test *t = test->priv;
+	u8 frame[LJCA_MAX_FRAME_SIZE];
+	struct ljca_msg *msg;
+	int packets = 0;
+	int len = 0;
+	u64 ns = 0;
+	u64 start;
+	int i, j;
+
+	for (j = 0; j < ARRAY_SIZE(types); j++) {
+		stubs[j] = ljca_stub_find(t->ljca, types[j]);
+		if (IS_ERR(stubs[j]))
+			stubs[j] = ljca_stub_alloc(t->ljca, types[j], 0);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, stubs[j]);
+
+		msg = (struct ljca_msg *)(frame + len);
+		msg->type = types[j];
+		msg->cmd = 1;
+		msg->flags = ACK_FLAG | CMPL_FLAG;
+		msg->len = 1;
+		msg->data[0] = j;
+		len += sizeof(*msg) + msg->len;
+		packets++;
+	}
+
+	msg = (struct ljca_msg *)(frame + len);
+	msg->type = GPIO_STUB;
+	msg->cmd = 2;
+	msg->flags = CMPL_FLAG;
+	msg->len = 2;
+	msg->data[0] = 0;
+	msg->data[1] = 1;
+	len += sizeof(*msg) + msg->len;
+	packets++;
+
+	for (i = 0; i < LJCA_TEST_BENCH_ROUNDS; i++) {
+		t->frame_count = 0;
+		for (j = 0; j < ARRAY_SIZE(types); j++)
+			KUNIT_ASSERT_EQ(test,
+					ljca_stub_write_async(stubs[j], 1,
+							      &types[j], 1,
+							      t->ibuf[j],
+							      sizeof(t->ibuf[j]),
+							      ljca_test_cmd_done,
+							      &c[j]),
+					0);
+
+		start = ktime_get_ns();
+		rcu_read_lock();
+		ljca_rx_msgs(t->ljca, frame, len, start);
+		rcu_read_unlock();
+		ns += ktime_get_ns() - start;
+
+		/* keep the event ring from filling up */
+		flush_work(&stubs[0]->event_work);
+	}
+
+	for (j = 0; j < ARRAY_SIZE(types); j++) {
+		KUNIT_EXPECT_EQ(test, c[j].calls, LJCA_TEST_BENCH_ROUNDS);
+		KUNIT_EXPECT_EQ(test, c[j].status, 0);
+		KUNIT_EXPECT_EQ(test, t->ibuf[j][0], j);
+	}
+	KUNIT_EXPECT_EQ(test, atomic_read(&t->ljca->rx_dropped), 0);
+
+	kunit_info(test, "dispatch: %llu ns per packet over %d packets\n",
+		   div_u64(ns, LJCA_TEST_BENCH_ROUNDS * packets),
+		   LJCA_TEST_BENCH_ROUNDS * packets);
+}
+
+static int ljca_test_init(struct kunit *test)
+{
+	struct ljca_dev *ljca;
+	struct ljca_stub *stub;
+	struct ljca_test *t;
+	int i;
+
+	t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return -ENOMEM;
+
+	ljca = kzalloc(sizeof(*ljca), GFP_KERNEL);
+	if (!ljca)
+		return -ENOMEM;
+
+	ljca->stats = alloc_percpu(struct ljca_dev_stats);
+	if (!ljca->stats) {
+		kfree(ljca);
+		return -ENOMEM;
+	}
+
+	ljca_init(ljca);
+	ljca->ops = &ljca_test_ops;
+	ljca->intf = &t->intf;
+	usb_set_intfdata(&t->intf, ljca);
+	ljca->frame_size = MAX_PACKET_SIZE;
+	ljca->max_payload = ljca->frame_size - sizeof(struct ljca_msg);
+	spin_lock_init(&t->lock);
+	init_waitqueue_head(&t->sent_wq);
+	t->ljca = ljca;
+	test->priv = t;
+
+	for (i = 0; i < LJCA_TX_BUFS; i++) {
+		ljca->tx_bufs[i].buf = kzalloc(LJCA_MAX_FRAME_SIZE, GFP_KERNEL);
+		if (!ljca->tx_bufs[i].buf)
+			return -ENOMEM;
+
+		list_add_tail(&ljca->tx_bufs[i].list, &ljca->tx_free);
+	}
+
+	stub = ljca_stub_alloc(ljca, I2C_STUB, 0);
+	if (IS_ERR(stub))
+		return PTR_ERR(stub);
+
+	t->pdata.ljca = ljca;
+	t->pdata.type = I2C_STUB;
+	t->pdev.dev.platform_data = &t->pdata;
+	ljca->state = LJCA_STARTED;
+
+	return 0;
+}
+
+static void ljca_test_exit(struct kunit *test)
+{
+	struct ljca_test *t = test->priv;
+	struct ljca_dev *ljca;
+	int i;
+
+	if (!t)
+		return;
+
+	ljca = t->ljca;
+	ljca_halt(ljca);
+	/* the commands they waited for failed, what they send next fails */
+	for (i = 0; i < t->worker_count; i++)
+		flush_work(&t->workers[i].work);
+	ljca_stub_cleanup(ljca);
+	for (i = 0; i < LJCA_TX_BUFS; i++)
+		kfree(ljca->tx_bufs[i].buf);
+	free_percpu(ljca->stats);
+	kfree(ljca);
+}
+
+static struct kunit_case ljca_test_cases[] = {
+	KUNIT_CASE(ljca_test_async_complete),
+	KUNIT_CASE(ljca_test_batch_partial_failure),
+	KUNIT_CASE(ljca_test_ordering),
+	KUNIT_CASE(ljca_test_concurrency),
+	KUNIT_CASE(ljca_test_dispatch_bench),
+	{}
+};
+
+static struct kunit_suite ljca_test_suite = {
+	.name = "ljca",
+	.init = ljca_test_init,
+	.exit = ljca_test_exit,
+	.test_cases = ljca_test_cases,
+};
+kunit_test_suite(ljca_test_suite);
@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Intel La Jolla Cove Adapter USB driver tracepoints
+ *
+ * Copyright (c) 2021, Intel Corporation.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ljca
+
+#if !defined(_LJCA_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LJCA_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/usb.h>
+
+DECLARE_EVENT_CLASS(ljca_msg,
+	TP_PROTO(struct usb_device *udev, u8 type, u8 cmd, u8 flags,
+		 const void *data, u8 len),
+	TP_ARGS(udev, type, cmd, flags, data, len),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		__field(u8, type)
+		__field(u8, cmd)
+		__field(u8, flags)
+		__dynamic_array(u8, data, len)
+	),
+	TP_fast_assign(
+		__entry->busnum = udev->bus->busnum;
+		__entry->devnum = udev->devnum;
+		__entry->type = type;
+		__entry->cmd = cmd;
+		__entry->flags = flags;
+		memcpy(__get_dynamic_array(data), data, len);
+	),
+	TP_printk("%d-%d type:%u cmd:%u flags:%#x len:%u data:%s",
+		  __entry->busnum, __entry->devnum, __entry->type, __entry->cmd,
+		  __entry->flags, __get_dynamic_array_len(data),
+		  __print_hex(__get_dynamic_array(data),
+			      __get_dynamic_array_len(data)))
+);
+
+DEFINE_EVENT(ljca_msg, ljca_send,
+	TP_PROTO(struct usb_device *udev, u8 type, u8 cmd, u8 flags,
+		 const void *data, u8 len),
+	TP_ARGS(udev, type, cmd, flags, data, len)
+);
+
+DEFINE_EVENT(ljca_msg, ljca_event,
+	TP_PROTO(struct usb_device *udev, u8 type, u8 cmd, u8 flags,
+		 const void *data, u8 len),
+	TP_ARGS(udev, type, cmd, flags, data, len)
+);
+
+TRACE_EVENT(ljca_ack,
+	TP_PROTO(struct usb_device *udev, u8 type, u8 cmd, const void *data,
+		 u8 len, s64 latency_us),
+	TP_ARGS(udev, type, cmd, data, len, latency_us),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		__field(u8, type)
+		__field(u8, cmd)
+		__field(s64, latency_us)
+		__dynamic_array(u8, data, len)
+	),
+	TP_fast_assign(
+		__entry->busnum = udev->bus->busnum;
+		__entry->devnum = udev->devnum;
+		__entry->type = type;
+		__entry->cmd = cmd;
+		__entry->latency_us = latency_us;
+		memcpy(__get_dynamic_array(data), data, len);
+	),
+	TP_printk("%d-%d type:%u cmd:%u latency:%lldus len:%u data:%s",
+		  __entry->busnum, __entry->devnum, __entry->type, __entry->cmd,
+		  __entry->latency_us, __get_dynamic_array_len(data),
+		  __print_hex(__get_dynamic_array(data),
+			      __get_dynamic_array_len(data)))
+);
+
+TRACE_EVENT(ljca_timeout,
+	TP_PROTO(struct usb_device *udev, u8 type, u8 cmd),
+	TP_ARGS(udev, type, cmd),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		__field(u8, type)
+		__field(u8, cmd)
+	),
+	TP_fast_assign(
+		__entry->busnum = udev->bus->busnum;
+		__entry->devnum = udev->devnum;
+		__entry->type = type;
+		__entry->cmd = cmd;
+	),
+	TP_printk("%d-%d type:%u cmd:%u", __entry->busnum, __entry->devnum,
+		  __entry->type, __entry->cmd)
+);
+
+#endif /* _LJCA_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ljca-trace
+#include <trace/define_trace.h>
@@ -6,17 +6,36 @@
  */
 
 #include <linux/acpi.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/devcoredump.h>
+#include <linux/jump_label.h>
 #include <linux/kernel.h>
+#include <linux/kfifo.h>
 #include <linux/mfd/core.h>
 #include <linux/mfd/ljca.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
 #include <linux/platform_device.h>
+#include <linux/pm_runtime.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
+#include <linux/seq_file.h>
+#include <linux/sizes.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/timer.h>
 #include <linux/types.h>
 #include <linux/uaccess.h>
 #include <linux/usb.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#define CREATE_TRACE_POINTS
+#include "ljca-trace.h"
 
 enum ljca_acpi_match_adr {
 	LJCA_ACPI_MATCH_GPIO,
@@ -32,7 +51,6 @@ static char *gpio_hids[] = {
 	"INTC10D1", /* MTL */
 	"INTC10B5", /* LNL */
 };
-static struct mfd_cell_acpi_match ljca_acpi_match_gpio;
 
 static char *i2c_hids[] = {
 	"INTC1075", /* TGL */
@@ -40,7 +58,6 @@ static char *i2c_hids[] = {
 	"INTC100C", /* RPL */
 	"INTC10D2", /* MTL */
 };
-static struct mfd_cell_acpi_match ljca_acpi_match_i2cs[2];
 
 static char *spi_hids[] = {
 	"INTC1091", /* TGL */
@@ -48,7 +65,6 @@ static char *spi_hids[] = {
 	"INTC100D", /* RPL */
 	"INTC10D3", /* MTL */
 };
-static struct mfd_cell_acpi_match ljca_acpi_match_spis[1];
 
 struct ljca_msg {
 	u8 type;
@@ -74,6 +90,8 @@ enum stub_type {
 	SPI_STUB,
 };
 
+#define LJCA_NUM_STUBS (SPI_STUB + 1)
+
 /* command Flags */
 #define ACK_FLAG BIT(0)
 #define RESP_FLAG BIT(1)
@@ -141,34 +159,330 @@ struct ljca_gpio_descriptor {
 } __packed;
 
 #define MAX_PACKET_SIZE 64
-#define MAX_PAYLOAD_SIZE (MAX_PACKET_SIZE - sizeof(struct ljca_msg))
+/* the header's u8 len bounds a message whatever the endpoint allows */
+#define LJCA_MAX_FRAME_SIZE (sizeof(struct ljca_msg) + U8_MAX)
+
+enum ljca_enum_type {
+	LJCA_ENUM_GPIO,
+	LJCA_ENUM_I2C,
+	LJCA_ENUM_SPI,
+	LJCA_ENUM_NUM,
+};
+
+/*
+ * The checked enumeration descriptors of a bridge, cached across probes
+ * and keyed by the firmware version and the bridge's USB port.
+ */
+struct ljca_enum {
+	struct list_head list;
+	struct fw_version version;
+	char port[32];
+	int len[LJCA_ENUM_NUM];
+	u8 desc[LJCA_ENUM_NUM][LJCA_MAX_FRAME_SIZE];
+};
+
 #define USB_WRITE_TIMEOUT 200
 #define USB_WRITE_ACK_TIMEOUT 500
 #define USB_ENUM_STUB_TIMEOUT 20
 
+#define LJCA_ENUM_CACHE_MAX 4
+
+static LIST_HEAD(ljca_enum_cache);
+static int ljca_enum_count;
+static DEFINE_MUTEX(ljca_enum_lock);
+
+#define LJCA_MAX_RX_URBS 16
+/* the queue of events each stub keeps for its event_work */
+#define LJCA_EVENT_RING_SIZE SZ_4K
+
+static unsigned int rx_urbs = 4;
+module_param(rx_urbs, uint, 0444);
+MODULE_PARM_DESC(rx_urbs, "Number of bulk-in URBs kept submitted (1-16)");
+
+/*
+ * The firmware reports no capability for it, so messages longer than the
+ * 64 byte full-speed framing are opt-in.
+ */
+static bool large_frames;
+module_param(large_frames, bool, 0444);
+MODULE_PARM_DESC(large_frames,
+		 "Send messages up to the endpoint's max packet size (default 64 bytes)");
+
+/* not known to be understood by every firmware, so opt-in too */
+static bool tx_pack;
+module_param(tx_pack, bool, 0444);
+MODULE_PARM_DESC(tx_pack,
+		 "Pack the commands of a batch into shared bulk transfers");
+
+/*
+ * Resumes that follow shortly after the bridge went idle raise the USB
+ * autosuspend delay up to this, long idle periods let it fall back.
+ */
+static unsigned int autosuspend_max_ms = 5000;
+module_param(autosuspend_max_ms, uint, 0644);
+MODULE_PARM_DESC(autosuspend_max_ms,
+		 "Upper bound of the adaptive autosuspend delay, 0 disables tuning");
+
+/*
+ * Add the children from the descriptors the last probe of the same
+ * firmware read, and confirm them with the bridge afterwards.
+ */
+static bool enum_cache = true;
+module_param(enum_cache, bool, 0644);
+MODULE_PARM_DESC(enum_cache,
+		 "Add the children from the cached enumeration and confirm it in the background");
+
+/* not every firmware keeps a log worth the USB traffic, so opt-in */
+static bool fw_log;
+module_param(fw_log, bool, 0444);
+MODULE_PARM_DESC(fw_log,
+		 "Collect the firmware log in the background, read it from debugfs");
+
+#define LJCA_FW_LOG_SIZE SZ_16K
+/* the poll interval adapts between these, in ms */
+#define LJCA_FW_LOG_MIN_MS 20
+#define LJCA_FW_LOG_MAX_MS 1000
+/* how long the children have to be quiet before the log is polled */
+#define LJCA_FW_LOG_QUIET_NS (5 * NSEC_PER_MSEC)
+/*
+ * and after how long the bridge counts as idle and is no longer polled,
+ * below the autosuspend delay so the polls do not keep it awake
+ */
+#define LJCA_FW_LOG_IDLE_NS (LJCA_FW_LOG_MAX_MS * NSEC_PER_MSEC)
+
+/* the largest coredump read, and the most chunks it takes to get there */
+#define LJCA_COREDUMP_SIZE SZ_64K
+/* this many ACK timeouts within the window look like a firmware fault */
+#define LJCA_TIMEOUT_STORM 5
+#define LJCA_TIMEOUT_STORM_WINDOW (2 * HZ)
+/* automatic dumps are taken at most once in this long */
+#define LJCA_COREDUMP_INTERVAL (60 * HZ)
+
+static bool adaptive_rto = true;
+module_param(adaptive_rto, bool, 0644);
+MODULE_PARM_DESC(adaptive_rto,
+		 "Derive ACK timeouts from the measured round trips, and fail fast on a degraded link");
+
+/*
+ * The shortest ACK timeout round trips may bring a command down to. The
+ * firmware is only specified to answer within USB_WRITE_ACK_TIMEOUT, its
+ * slow commands get half of that however fast they usually are.
+ */
+#define LJCA_RTO_MIN_US (USB_WRITE_ACK_TIMEOUT / 2 * USEC_PER_MSEC)
+/* round trips taken before the estimate replaces the fixed timeout */
+#define LJCA_RTO_SAMPLES 8
+#define LJCA_RTO_MAX_BACKOFF 4
+/* timeouts of the children's commands in a row that degrade the link */
+#define LJCA_DEGRADED_TIMEOUTS 3
+#define LJCA_HEALTH_MIN_MS 100
+#define LJCA_HEALTH_MAX_MS 2000
+
+static unsigned int fw_stats_ms;
+module_param(fw_stats_ms, uint, 0444);
+MODULE_PARM_DESC(fw_stats_ms,
+		 "Sample the firmware statistics this often in ms, 0 only on debugfs reads");
+
+/* firmware statistics are sampled at most once in this long */
+#define LJCA_FW_STATS_MIN_NS NSEC_PER_SEC
+#define LJCA_FW_STATS_MAX (U8_MAX / sizeof(u32))
+
+#define LJCA_CAPTURE_SIZE SZ_64K
+#define LJCA_CAPTURE_OUT 0
+#define LJCA_CAPTURE_IN 1
+
+/*
+ * A record of the binary capture, the message as it went over the wire,
+ * header included, follows it. Records are back to back in the stream.
+ */
+struct ljca_capture_hdr {
+	__le64 ts_ns;
+	__le16 len;
+	u8 dir;
+	u8 reserved;
+} __packed;
+
+/* on while any bridge captures, keeps the disabled path a no-op */
+static DEFINE_STATIC_KEY_FALSE(ljca_capture_key);
+
+/* the least a short idle gap raises the autosuspend delay by */
+#define LJCA_PM_DELAY_STEP_MS 100
+
+/* command ids of every stub fit below this */
+#define LJCA_MAX_CMD 16
+/* ACK latency histogram, bucket n counts latencies below 2^n us */
+#define LJCA_LAT_BUCKETS 20
+
+struct ljca_cmd_stats {
+	u64 sent;
+	u64 acked;
+	u64 timeouts;
+	u64 mismatches;
+	/* ACKs taken by a command that had timed out already */
+	u64 late;
+	u64 bytes_out;
+	u64 bytes_in;
+	u64 latency[LJCA_LAT_BUCKETS];
+};
+
+struct ljca_stub_stats {
+	struct ljca_cmd_stats cmds[LJCA_MAX_CMD];
+};
+
+struct ljca_dev_stats {
+	u64 invalid;
+	/* from the read completion to the waiter woken or the event handled */
+	u64 ack_delay[LJCA_LAT_BUCKETS];
+	u64 event_delay[LJCA_LAT_BUCKETS];
+};
+
+/* an event queued for the stub's event_work */
+struct ljca_event_rec {
+	u64 ts_ns;
+	u8 cmd;
+	u8 data[];
+} __packed;
+
+/* the outcome of the last echo benchmark */
+struct ljca_bench_result {
+	int size;
+	int depth;
+	int count;
+	int errors;
+	/* replies that did not carry the payload back */
+	int not_echoed;
+	u64 elapsed_ns;
+	u64 p50_ns;
+	u64 p99_ns;
+	u64 p999_ns;
+};
+
 struct ljca_event_cb_entry {
 	struct platform_device *pdev;
 	ljca_event_cb_t notify;
 };
 
-struct ljca_stub_packet {
-	u8 *ibuf;
-	u32 ibuf_len;
+struct ljca_stub;
+struct ljca_dev;
+
+/*
+ * An in-flight command. The ACK carries no sequence number, so the tag a
+ * response is matched against is the stub type plus the command id.
+ */
+struct ljca_cmd {
+	struct list_head list;
+	struct ljca_stub *stub;
+	u8 cmd;
+	bool wait_ack;
+	bool acked;
+	/* the message left for the bridge, an ACK may come for it */
+	bool written;
+	/* set by whoever ends the command first, protected by cmd_lock */
+	bool finished;
+	/*
+	 * ended by a timeout shorter than USB_WRITE_ACK_TIMEOUT but left on
+	 * pending, in its place, to take the ACK that may still come for it.
+	 * Protected by cmd_lock.
+	 */
+	bool zombie;
+	int status;
+	void *ibuf;
+	/* what ibuf holds, a longer ACK fails the command */
+	int ibuf_size;
+	int ibuf_len;
+	ktime_t start;
+	struct timer_list timer;
+
+	/* called once the command ended, complete() done if NULL */
+	ljca_complete_cb_t complete;
+	void *context;
+	struct completion done;
+};
+
+/*
+ * A transmit buffer and the command it carries. References are held by
+ * the submitter, the write urb, the timeout timer and the unfinished
+ * command, the buffer goes back to the pool with the last one.
+ */
+struct ljca_tx_buf {
+	struct list_head list;
+	struct ljca_dev *ljca;
+	struct urb *urb;
+	void *buf;
+	dma_addr_t dma;
+	refcount_t ref;
+	struct ljca_cmd tag;
+	/* bytes to send, the messages packed behind this one included */
+	int len;
+
+	/*
+	 * messages copied behind this one into its urb, each holding its
+	 * urb reference until this urb completes
+	 */
+	struct list_head packed;
+	struct list_head pack_node;
+};
+
+/*
+ * How commands reach the bridge, USB unless a test put a fake in place.
+ * send() hands tx->len bytes of tx->buf over and ljca_write_done() is
+ * called once they left, unless it failed. cancel() makes a write stuck
+ * on the bus complete, pm_get() and pm_put() keep the bridge resumed for
+ * a command.
+ */
+struct ljca_transport_ops {
+	int (*send)(struct ljca_tx_buf *tx);
+	void (*cancel)(struct ljca_tx_buf *tx);
+	int (*pm_get)(struct ljca_dev *ljca);
+	void (*pm_put)(struct ljca_dev *ljca);
+};
+
+/* the round trip estimate of one command, RFC 6298 style, in us */
+struct ljca_rto {
+	u32 srtt;
+	u32 rttvar;
+	u8 samples;
+	/* the timeout doubles with every timeout until an ACK comes */
+	u8 backoff;
 };
 
 struct ljca_stub {
 	struct list_head list;
 	u8 type;
 	struct usb_interface *intf;
-	spinlock_t event_cb_lock;
-
-	struct ljca_stub_packet ipacket;
+	/* held around the event callback, which may sleep, and its updates */
+	struct mutex event_cb_lock;
 
-	/* for identify ack */
-	bool acked;
-	int cur_cmd;
+	/*
+	 * commands on one stub are serialized since their ACKs can't be told
+	 * apart, commands on different stubs are in flight concurrently
+	 */
+	struct mutex mutex;
 
-	struct ljca_event_cb_entry event_entry;
+	/*
+	 * held from queueing a command on pending until its urb is submitted,
+	 * so pending stays in wire order for the ACKs matched against it
+	 */
+	struct mutex submit_lock;
+
+	/* commands waiting for an ACK, protected by cmd_lock */
+	spinlock_t cmd_lock;
+	struct list_head pending;
+
+	struct ljca_event_cb_entry *event_entry;
+	struct ljca_stub_stats __percpu *stats;
+
+	/* updated by the parser and the timers, read when arming */
+	struct ljca_rto rto[LJCA_MAX_CMD];
+
+	/*
+	 * Events are handed to event_work so that handlers never hold up the
+	 * ACKs parsed in the read completion. The completions are serialized,
+	 * event_in is the producer's buffer and event_out the consumer's.
+	 */
+	struct kfifo_rec_ptr_2 events;
+	struct work_struct event_work;
+	u8 event_in[sizeof(struct ljca_event_rec) + U8_MAX];
+	u8 event_out[sizeof(struct ljca_event_rec) + U8_MAX];
 };
 
 static inline void *ljca_priv(const struct ljca_stub *stub)
@@ -192,29 +506,142 @@ enum ljca_state {
 struct ljca_dev {
 	struct usb_device *udev;
 	struct usb_interface *intf;
+	const struct ljca_transport_ops *ops;
 	u8 in_ep; /* the address of the bulk in endpoint */
 	u8 out_ep; /* the address of the bulk out endpoint */
 
-	/* the urb/buffer for read */
-	struct urb *in_urb;
-	unsigned char *ibuf;
+	/* the urbs/buffers for write, taken from tx_free under tx_lock */
+	struct ljca_tx_buf tx_bufs[LJCA_TX_BUFS];
+	/* bytes of one message, header included, and its payload */
+	int frame_size;
+	int max_payload;
+	struct list_head tx_free;
+	spinlock_t tx_lock;
+	wait_queue_head_t tx_wq;
+
+	/* the urbs for read, anchored while submitted */
+	struct usb_anchor rx_anchor;
+	struct urb **in_urbs;
+	int in_urb_count;
+	atomic_t rx_submitted;
 	size_t ibuf_len;
 
+	/* how often every read urb was out of the controller at once */
+	atomic_t rx_all_busy;
+	/* events lost to a full stub queue */
+	atomic_t rx_dropped;
+
+	struct ljca_dev_stats __percpu *stats;
+	struct dentry *debugfs_dir;
+
+	/* runtime PM, resumes and the wait they added to commands */
+	atomic_t pm_resumes;
+	/* ns timestamp of the last command that ended */
+	atomic64_t pm_last_busy;
+	struct mutex pm_lock;
+	int pm_adapted;
+	u64 pm_stalls;
+	u64 pm_stall_ns;
+	u64 pm_stall_max_ns;
+	/* the autosuspend delay found at probe and the one last set, in ms */
+	int pm_base_delay;
+	int pm_delay;
+
 	int state;
 
 	struct list_head stubs_list;
-
-	/* to wait for an ongoing write ack */
-	wait_queue_head_t ack_wq;
+	/* published once the stub is set up, looked up by the parser */
+	struct ljca_stub __rcu *stubs[LJCA_NUM_STUBS];
 
 	struct mfd_cell *cells;
 	int cell_count;
-	struct mutex mutex;
+
+	struct fw_version fw_version;
+	/* the children were added from the cache, enum_work confirms it */
+	bool enum_cached;
+	struct work_struct enum_work;
+
+	/* parent of sub-devices and the ACPI nodes found below it */
+	struct device *sub_dev_parent;
+	struct mfd_cell_acpi_match acpi_match_gpio;
+	struct mfd_cell_acpi_match acpi_match_i2cs[2];
+	struct mfd_cell_acpi_match acpi_match_spis[1];
+
+	/* commands of other stubs than DIAG in flight, and the last one sent */
+	atomic_t io_pending;
+	wait_queue_head_t io_wq;
+	atomic64_t io_last_ns;
+
+	/* firmware log collector, the worker is the ring's single producer */
+	struct delayed_work fw_log_work;
+	struct kfifo fw_log;
+	void *fw_log_buf;
+	/* serializes the readers of the ring */
+	struct mutex fw_log_lock;
+	wait_queue_head_t fw_log_wq;
+	unsigned int fw_log_interval;
+	u64 fw_log_bytes;
+	u64 fw_log_dropped;
+
+	/* coredump capture, started by ljca_coredump_request() */
+	struct work_struct coredump_work;
+	spinlock_t storm_lock;
+	unsigned long storm_start;
+	int storm_count;
+	unsigned long coredump_next;
+
+	/* binary capture, writers hold capture_lock, the reader the mutex */
+	bool capture_on;
+	struct kfifo capture;
+	spinlock_t capture_lock;
+	struct mutex capture_mutex;
+	wait_queue_head_t capture_wq;
+	u64 capture_dropped;
+
+	/* the last two samples of the firmware statistics, under the mutex */
+	struct delayed_work fw_stats_work;
+	struct mutex fw_stats_lock;
+	u8 fw_stats_buf[LJCA_MAX_FRAME_SIZE];
+	u8 fw_state[LJCA_MAX_FRAME_SIZE];
+	int fw_state_len;
+	u32 fw_stats[LJCA_FW_STATS_MAX];
+	u32 fw_stats_prev[LJCA_FW_STATS_MAX];
+	int fw_stats_num;
+	u64 fw_stats_ns;
+	u64 fw_stats_prev_ns;
+
+	/*
+	 * Timeouts of the children's commands since the last ACK. Past
+	 * LJCA_DEGRADED_TIMEOUTS their commands fail at once until
+	 * health_work got an answer from the bridge.
+	 */
+	atomic_t timeouts_in_row;
+	bool degraded;
+	struct delayed_work health_work;
+	unsigned int health_delay;
+
+	/*
+	 * echo benchmark, the DIAG works are cancelled while it runs and
+	 * other commands fail with -EBUSY, the bridge would only echo them.
+	 * A run is cut off after LJCA_BENCH_MAX_MS.
+	 */
+	struct mutex bench_lock;
+	bool bench_running;
+	struct ljca_bench_result bench_result;
+};
+
+struct ljca_match_ctx {
+	struct ljca_dev *ljca;
+	int child_count;
 };
 
-/* parent of sub-devices */
-struct device *sub_dev_parent;
-struct device *cur_dev;
+/* the bridge a child belongs to */
+static struct ljca_dev *ljca_from_pdev(struct platform_device *pdev)
+{
+	struct ljca_platform_data *pdata = dev_get_platdata(&pdev->dev);
+
+	return pdata->ljca;
+}
 
 static int try_match_acpi_hid(struct acpi_device *child, char **hids, int hids_num)
 {
@@ -232,10 +659,12 @@ static int try_match_acpi_hid(struct acpi_device *child, char **hids, int hids_n
 
 static int match_device_ids(struct acpi_device *adev, void *data)
 {
+	struct ljca_match_ctx *ctx = data;
+	struct ljca_dev *ljca = ctx->ljca;
 	int ret;
-	int *child_count = data;
 
-	dev_dbg(&adev->dev, "adev->dep_unmet %d %d\n", adev->dep_unmet, *child_count);
+	dev_dbg(&adev->dev, "adev->dep_unmet %d %d\n", adev->dep_unmet,
+		ctx->child_count);
 
 	/* dependency not ready */
 	if (adev->dep_unmet)
@@ -243,35 +672,36 @@ static int match_device_ids(struct acpi_device *adev, void *data)
 
 	ret = try_match_acpi_hid(adev, gpio_hids, ARRAY_SIZE(gpio_hids));
 	if (ret >= 0 && ret < ARRAY_SIZE(gpio_hids)) {
-		ljca_acpi_match_gpio.pnpid = gpio_hids[ret];
-		(*child_count)++;
+		ljca->acpi_match_gpio.pnpid = gpio_hids[ret];
+		ctx->child_count++;
 		return 0;
 	}
 
 	ret = try_match_acpi_hid(adev, i2c_hids, ARRAY_SIZE(i2c_hids));
 	if (ret >= 0 && ret < ARRAY_SIZE(i2c_hids)) {
-		ljca_acpi_match_i2cs[0].pnpid = i2c_hids[ret];
-		ljca_acpi_match_i2cs[1].pnpid = i2c_hids[ret];
-		(*child_count)++;
+		ljca->acpi_match_i2cs[0].pnpid = i2c_hids[ret];
+		ljca->acpi_match_i2cs[1].pnpid = i2c_hids[ret];
+		ctx->child_count++;
 		return 0;
 	}
 
 	ret = try_match_acpi_hid(adev, spi_hids, ARRAY_SIZE(spi_hids));
 	if (ret >= 0 && ret < ARRAY_SIZE(spi_hids)) {
-		ljca_acpi_match_spis[0].pnpid = spi_hids[ret];
-		(*child_count)++;
+		ljca->acpi_match_spis[0].pnpid = spi_hids[ret];
+		ctx->child_count++;
 		return 0;
 	}
 
 	return 0;
 }
 
-static int precheck_acpi_hid(struct usb_interface *intf)
+static int precheck_acpi_hid(struct ljca_dev *ljca,
+			     struct usb_interface *intf)
 {
+	struct ljca_match_ctx ctx = { .ljca = ljca };
 	struct device *parents[2];
 	struct acpi_device *adev;
 	int i;
-	int child_count;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0)
 	struct acpi_device *child;
 #endif
@@ -286,26 +716,26 @@ static int precheck_acpi_hid(struct usb_interface *intf)
 		return -ENODEV;
 
 	acpi_dev_clear_dependencies(adev);
-	sub_dev_parent = parents[0];
+	ljca->sub_dev_parent = parents[0];
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
 	for (i = 0; i < ARRAY_SIZE(parents); i++) {
-		child_count = 0;
-		acpi_dev_for_each_child(ACPI_COMPANION(parents[i]), match_device_ids, &child_count);
-		if (child_count > 0) {
-			sub_dev_parent = parents[i];
+		ctx.child_count = 0;
+		acpi_dev_for_each_child(ACPI_COMPANION(parents[i]), match_device_ids, &ctx);
+		if (ctx.child_count > 0) {
+			ljca->sub_dev_parent = parents[i];
 			break;
 		}
 	}
 #else
 	for (i = 0; i < ARRAY_SIZE(parents); i++) {
-		child_count = 0;
+		ctx.child_count = 0;
 		list_for_each_entry(child, &(ACPI_COMPANION(parents[i])->children), node) {
-			match_device_ids(child, &child_count);
+			match_device_ids(child, &ctx);
 		}
 
-		if (child_count > 0) {
-			sub_dev_parent = parents[i];
+		if (ctx.child_count > 0) {
+			ljca->sub_dev_parent = parents[i];
 			break;
 		}
 	}
@@ -314,30 +744,94 @@ static int precheck_acpi_hid(struct usb_interface *intf)
 	return 0;
 }
 
+/* whether data starts with a whole message, more may follow it */
 static bool ljca_validate(void *data, u32 data_len)
 {
 	struct ljca_msg *header = (struct ljca_msg *)data;
 
-	return (header->len + sizeof(*header) == data_len);
+	if (data_len < sizeof(*header))
+		return false;
+
+	return (header->len + sizeof(*header) <= data_len);
 }
 
-static void ljca_dump(struct ljca_dev *ljca, void *buf, int len)
+static void __ljca_capture(struct ljca_dev *ljca, u8 dir,
+			   const struct ljca_msg *msg)
 {
-	int i;
-	u8 tmp[256] = { 0 };
-	int n = 0;
+	struct ljca_capture_hdr hdr = {
+		.ts_ns = cpu_to_le64(ktime_get_real_ns()),
+		.dir = dir,
+	};
+	unsigned int len = sizeof(*msg) + msg->len;
+	unsigned long flags;
+	bool wake = false;
 
-	if (!len)
-		return;
+	hdr.len = cpu_to_le16(len);
+
+	spin_lock_irqsave(&ljca->capture_lock, flags);
+	if (!ljca->capture_on)
+		goto out;
+
+	/* a record goes in whole or not at all */
+	if (kfifo_avail(&ljca->capture) < sizeof(hdr) + len) {
+		ljca->capture_dropped++;
+		goto out;
+	}
+
+	kfifo_in(&ljca->capture, (u8 *)&hdr, sizeof(hdr));
+	kfifo_in(&ljca->capture, (u8 *)msg, len);
+	wake = true;
+out:
+	spin_unlock_irqrestore(&ljca->capture_lock, flags);
+
+	if (wake)
+		wake_up_interruptible(&ljca->capture_wq);
+}
+
+static inline void ljca_capture(struct ljca_dev *ljca, u8 dir,
+				const struct ljca_msg *msg)
+{
+	if (static_branch_unlikely(&ljca_capture_key))
+		__ljca_capture(ljca, dir, msg);
+}
+
+static int ljca_capture_set(struct ljca_dev *ljca, bool on)
+{
+	int ret = 0;
 
-	for (i = 0; i < len; i++)
-		n += scnprintf(tmp + n, sizeof(tmp) - n - 1, "%02x ",
-			       ((u8 *)buf)[i]);
+	mutex_lock(&ljca->capture_mutex);
+	if (on == ljca->capture_on)
+		goto out;
 
-	dev_dbg(&ljca->intf->dev, "%s\n", tmp);
+	if (on) {
+		ret = kfifo_alloc(&ljca->capture, LJCA_CAPTURE_SIZE,
+				  GFP_KERNEL);
+		if (ret)
+			goto out;
+
+		ljca->capture_dropped = 0;
+		spin_lock_irq(&ljca->capture_lock);
+		ljca->capture_on = true;
+		spin_unlock_irq(&ljca->capture_lock);
+		static_branch_inc(&ljca_capture_key);
+	} else {
+		static_branch_dec(&ljca_capture_key);
+		spin_lock_irq(&ljca->capture_lock);
+		ljca->capture_on = false;
+		spin_unlock_irq(&ljca->capture_lock);
+		/* no writer looks at the ring anymore */
+		kfifo_free(&ljca->capture);
+		wake_up_interruptible(&ljca->capture_wq);
+	}
+out:
+	mutex_unlock(&ljca->capture_mutex);
+	return ret;
 }
 
-static struct ljca_stub *ljca_stub_alloc(struct ljca_dev *ljca, int priv_size)
+static void ljca_event_work(struct work_struct *work);
+
+static struct ljca_stub *ljca_stub_alloc(struct ljca_dev *ljca, u8 type,
+					 int priv_size)
 {
 	struct ljca_stub *stub;
 
@@ -345,692 +839,2544 @@ static struct ljca_stub *ljca_stub_alloc(struct ljca_dev *ljca, int priv_size)
 	if (!stub)
 		return ERR_PTR(-ENOMEM);
 
-	spin_lock_init(&stub->event_cb_lock);
+	stub->stats = alloc_percpu(struct ljca_stub_stats);
+	if (!stub->stats) {
+		kfree(stub);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	if (kfifo_alloc(&stub->events, LJCA_EVENT_RING_SIZE, GFP_KERNEL)) {
+		free_percpu(stub->stats);
+		kfree(stub);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	INIT_WORK(&stub->event_work, ljca_event_work);
+	stub->type = type;
+	stub->intf = ljca->intf;
+	mutex_init(&stub->event_cb_lock);
+	mutex_init(&stub->mutex);
+	mutex_init(&stub->submit_lock);
+	spin_lock_init(&stub->cmd_lock);
+	INIT_LIST_HEAD(&stub->pending);
 	INIT_LIST_HEAD(&stub->list);
 	list_add_tail(&stub->list, &ljca->stubs_list);
+	rcu_assign_pointer(ljca->stubs[type], stub);
 	dev_dbg(&ljca->intf->dev, "enuming a stub success\n");
 	return stub;
 }
 
+/*
+ * Stubs are only retired at disconnect, after the children are removed and
+ * reading stopped, so callers other than the parser skip the RCU read lock.
+ */
 static struct ljca_stub *ljca_stub_find(struct ljca_dev *ljca, u8 type)
 {
-	struct ljca_stub *stub;
+	struct ljca_stub *stub = NULL;
 
-	list_for_each_entry (stub, &ljca->stubs_list, list) {
-		if (stub->type == type)
-			return stub;
-	}
+	if (type < LJCA_NUM_STUBS)
+		stub = rcu_dereference_check(ljca->stubs[type], 1);
 
-	dev_err(&ljca->intf->dev, "usb stub not find, type: %d", type);
-	return ERR_PTR(-ENODEV);
+	return stub ? stub : ERR_PTR(-ENODEV);
 }
 
 static void ljca_stub_notify(struct ljca_stub *stub, u8 cmd,
 			     const void *evt_data, int len)
 {
-	unsigned long flags;
-	spin_lock_irqsave(&stub->event_cb_lock, flags);
-	if (stub->event_entry.notify && stub->event_entry.pdev)
-		stub->event_entry.notify(stub->event_entry.pdev, cmd, evt_data,
-					 len);
-	spin_unlock_irqrestore(&stub->event_cb_lock, flags);
+	mutex_lock(&stub->event_cb_lock);
+	if (stub->event_entry)
+		stub->event_entry->notify(stub->event_entry->pdev, cmd,
+					  evt_data, len);
+	mutex_unlock(&stub->event_cb_lock);
 }
 
-static int ljca_parse(struct ljca_dev *ljca, struct ljca_msg *header)
+static struct ljca_cmd_stats __percpu *ljca_cmd_stats(struct ljca_stub *stub,
+						      u8 cmd)
 {
-	struct ljca_stub *stub;
+	/* unknown command ids are accounted to the unused id 0 */
+	return &stub->stats->cmds[cmd < LJCA_MAX_CMD ? cmd : 0];
+}
 
-	stub = ljca_stub_find(ljca, header->type);
-	if (IS_ERR(stub))
-		return PTR_ERR(stub);
+static bool ljca_stub_is_child(struct ljca_stub *stub)
+{
+	return stub->type >= GPIO_STUB;
+}
 
-	if (!(header->flags & ACK_FLAG)) {
-		ljca_stub_notify(stub, header->cmd, header->data, header->len);
-		return 0;
-	}
+static void ljca_rto_update(struct ljca_stub *stub, u8 cmd, u32 us)
+{
+	struct ljca_rto *rto;
+	u32 err;
 
-	if (stub->cur_cmd != header->cmd) {
-		dev_err(&ljca->intf->dev, "header->cmd:%x != stub->cur_cmd:%x",
-			header->cmd, stub->cur_cmd);
-		return -EINVAL;
-	}
+	if (cmd >= LJCA_MAX_CMD)
+		return;
 
-	stub->ipacket.ibuf_len = header->len;
-	if (stub->ipacket.ibuf)
-		memcpy(stub->ipacket.ibuf, header->data, header->len);
+	rto = &stub->rto[cmd];
+	if (!rto->samples) {
+		rto->srtt = us;
+		rto->rttvar = us / 2;
+	} else {
+		err = abs((s64)rto->srtt - us);
+		rto->rttvar = rto->rttvar - rto->rttvar / 4 + err / 4;
+		rto->srtt = rto->srtt - rto->srtt / 8 + us / 8;
+	}
 
-	stub->acked = true;
-	wake_up(&ljca->ack_wq);
+	if (rto->samples < LJCA_RTO_SAMPLES)
+		rto->samples++;
+	rto->backoff = 0;
+}
 
-	return 0;
+static void ljca_rto_backoff(struct ljca_stub *stub, u8 cmd)
+{
+	if (cmd < LJCA_MAX_CMD && stub->rto[cmd].backoff < LJCA_RTO_MAX_BACKOFF)
+		stub->rto[cmd].backoff++;
 }
 
-static int ljca_stub_write(struct ljca_stub *stub, u8 cmd, const void *obuf,
-			   int obuf_len, void *ibuf, int *ibuf_len,
-			   bool wait_ack, int timeout)
+/* the ACK timeout in ms for cmd, never above what the caller allowed */
+static int ljca_rto(struct ljca_stub *stub, u8 cmd, int timeout)
 {
-	struct ljca_msg *header;
-	struct ljca_dev *ljca = usb_get_intfdata(stub->intf);
-	int ret;
-	u8 flags = CMPL_FLAG;
-	int actual;
+	struct ljca_rto *rto;
+	u64 us;
 
-	if (ljca->state == LJCA_STOPPED)
-		return -ENODEV;
+	if (!adaptive_rto || cmd >= LJCA_MAX_CMD)
+		return timeout;
 
-	if (obuf_len > MAX_PAYLOAD_SIZE)
-		return -EINVAL;
+	rto = &stub->rto[cmd];
+	if (READ_ONCE(rto->samples) < LJCA_RTO_SAMPLES)
+		return timeout;
 
-	if (wait_ack)
-		flags |= ACK_FLAG;
+	us = max_t(u64, READ_ONCE(rto->srtt) + 4ULL * READ_ONCE(rto->rttvar),
+		   LJCA_RTO_MIN_US);
+	us <<= READ_ONCE(rto->backoff);
 
-	stub->ipacket.ibuf_len = 0;
-	header = kmalloc(sizeof(*header) + obuf_len, GFP_KERNEL);
-	if (!header)
-		return -ENOMEM;
+	return min_t(u64, timeout, DIV_ROUND_UP_ULL(us, USEC_PER_MSEC));
+}
 
-	header->type = stub->type;
-	header->cmd = cmd;
-	header->flags = flags;
-	header->len = obuf_len;
+static int ljca_lat_bucket(u64 us)
+{
+	return min_t(int, fls64(us), LJCA_LAT_BUCKETS - 1);
+}
 
-	memcpy(header->data, obuf, obuf_len);
-	dev_dbg(&ljca->intf->dev, "send: type:%d cmd:%d flags:%d len:%d\n",
-		header->type, header->cmd, header->flags, header->len);
-	ljca_dump(ljca, header->data, header->len);
-
-	mutex_lock(&ljca->mutex);
-	stub->cur_cmd = cmd;
-	stub->ipacket.ibuf = ibuf;
-	stub->acked = false;
-	usb_autopm_get_interface(ljca->intf);
-	ret = usb_bulk_msg(ljca->udev,
-			   usb_sndbulkpipe(ljca->udev, ljca->out_ep), header,
-			   sizeof(struct ljca_msg) + obuf_len, &actual,
-			   USB_WRITE_TIMEOUT);
-	kfree(header);
-	if (ret || actual != sizeof(struct ljca_msg) + obuf_len) {
-		dev_err(&ljca->intf->dev,
-			"bridge write failed ret:%d total_len:%d\n ", ret,
-			actual);
-		goto error;
-	}
+static void ljca_stats_ack(struct ljca_stub *stub, u8 cmd, ktime_t start,
+			   int len)
+{
+	struct ljca_cmd_stats __percpu *stats = ljca_cmd_stats(stub, cmd);
+	u64 us = ktime_us_delta(ktime_get(), start);
 
-	if (wait_ack) {
-		ret = wait_event_timeout(ljca->ack_wq, stub->acked,
-					 msecs_to_jiffies(timeout));
-		if (!ret || !stub->acked) {
-			dev_err(&ljca->intf->dev,
-				"acked sem wait timed out ret:%d timeout:%d ack:%d\n",
-				ret, timeout, stub->acked);
-			ret = -ETIMEDOUT;
-			goto error;
-		}
-	}
+	ljca_rto_update(stub, cmd, min_t(u64, us, U32_MAX));
+	this_cpu_inc(stats->acked);
+	this_cpu_add(stats->bytes_in, len);
+	this_cpu_inc(stats->latency[ljca_lat_bucket(us)]);
+}
 
-	if (ibuf_len)
-		*ibuf_len = stub->ipacket.ibuf_len;
+static struct ljca_cmd *ljca_cmd_find(struct ljca_stub *stub, u8 cmd)
+{
+	struct ljca_cmd *pending;
 
-	stub->ipacket.ibuf = NULL;
-	stub->ipacket.ibuf_len = 0;
-	ret = 0;
-error:
-	usb_autopm_put_interface(ljca->intf);
-	mutex_unlock(&ljca->mutex);
-	return ret;
+	list_for_each_entry (pending, &stub->pending, list) {
+		if (pending->cmd == cmd)
+			return pending;
+	}
+
+	return NULL;
 }
 
-static int ljca_transfer_internal(struct platform_device *pdev, u8 cmd,
-				  const void *obuf, int obuf_len, void *ibuf,
-				  int *ibuf_len, bool wait_ack)
+/* take a free buffer without waiting, NULL if there is none */
+static struct ljca_tx_buf *ljca_tx_buf_get(struct ljca_dev *ljca)
 {
-	struct ljca_platform_data *ljca_pdata;
-	struct ljca_dev *ljca;
-	struct ljca_stub *stub;
+	struct ljca_tx_buf *tx;
+	struct ljca_cmd *tag;
+	unsigned long flags;
 
-	if (!pdev)
-		return -EINVAL;
+	spin_lock_irqsave(&ljca->tx_lock, flags);
+	tx = list_first_entry_or_null(&ljca->tx_free, struct ljca_tx_buf,
+				      list);
+	if (tx)
+		list_del(&tx->list);
+	spin_unlock_irqrestore(&ljca->tx_lock, flags);
+
+	if (!tx)
+		return NULL;
+
+	refcount_set(&tx->ref, 1);
+	tag = &tx->tag;
+	tag->acked = false;
+	tag->written = false;
+	tag->finished = false;
+	tag->zombie = false;
+	tag->status = 0;
+	tag->ibuf = NULL;
+	tag->ibuf_size = 0;
+	tag->ibuf_len = 0;
+	tag->complete = NULL;
+	tag->context = NULL;
+	reinit_completion(&tag->done);
+	return tx;
+}
 
-	ljca = dev_get_drvdata(cur_dev);
-	ljca_pdata = dev_get_platdata(&pdev->dev);
-	stub = ljca_stub_find(ljca, ljca_pdata->type);
-	if (IS_ERR(stub))
-		return PTR_ERR(stub);
+static struct ljca_tx_buf *ljca_tx_buf_alloc(struct ljca_dev *ljca)
+{
+	struct ljca_tx_buf *tx;
 
-	return ljca_stub_write(stub, cmd, obuf, obuf_len, ibuf, ibuf_len,
-			       wait_ack, USB_WRITE_ACK_TIMEOUT);
+	wait_event(ljca->tx_wq, (tx = ljca_tx_buf_get(ljca)));
+	return tx;
 }
 
-int ljca_transfer(struct platform_device *pdev, u8 cmd, const void *obuf,
-		  int obuf_len, void *ibuf, int *ibuf_len)
+static void ljca_tx_buf_put(struct ljca_dev *ljca, struct ljca_tx_buf *tx)
 {
-	return ljca_transfer_internal(pdev, cmd, obuf, obuf_len, ibuf, ibuf_len,
-				      true);
+	unsigned long flags;
+
+	spin_lock_irqsave(&ljca->tx_lock, flags);
+	list_add(&tx->list, &ljca->tx_free);
+	spin_unlock_irqrestore(&ljca->tx_lock, flags);
+	wake_up(&ljca->tx_wq);
 }
-EXPORT_SYMBOL_GPL(ljca_transfer);
 
-int ljca_transfer_noack(struct platform_device *pdev, u8 cmd, const void *obuf,
-			int obuf_len)
+static void ljca_tx_buf_unref(struct ljca_tx_buf *tx)
 {
-	return ljca_transfer_internal(pdev, cmd, obuf, obuf_len, NULL, NULL,
-				      false);
+	if (refcount_dec_and_test(&tx->ref))
+		ljca_tx_buf_put(tx->ljca, tx);
 }
-EXPORT_SYMBOL_GPL(ljca_transfer_noack);
 
-int ljca_register_event_cb(struct platform_device *pdev,
-			   ljca_event_cb_t event_cb)
+static struct ljca_tx_buf *ljca_tx_buf_lookup(struct ljca_dev *ljca,
+					      void *payload)
 {
-	struct ljca_platform_data *ljca_pdata;
-	struct ljca_dev *ljca;
-	struct ljca_stub *stub;
-	unsigned long flags;
+	int i;
 
-	if (!pdev)
-		return -EINVAL;
+	for (i = 0; i < LJCA_TX_BUFS; i++) {
+		if (ljca->tx_bufs[i].buf + sizeof(struct ljca_msg) == payload)
+			return &ljca->tx_bufs[i];
+	}
 
-	ljca = dev_get_drvdata(cur_dev);
-	ljca_pdata = dev_get_platdata(&pdev->dev);
-	stub = ljca_stub_find(ljca, ljca_pdata->type);
-	if (IS_ERR(stub))
-		return PTR_ERR(stub);
+	return NULL;
+}
 
-	spin_lock_irqsave(&stub->event_cb_lock, flags);
-	stub->event_entry.notify = event_cb;
-	stub->event_entry.pdev = pdev;
-	spin_unlock_irqrestore(&stub->event_cb_lock, flags);
+/* must hold cmd_lock, returns true if the caller is the one to end it */
+static bool ljca_cmd_claim(struct ljca_cmd *tag)
+{
+	if (tag->finished)
+		return false;
 
-	return 0;
+	tag->finished = true;
+	list_del_init(&tag->list);
+	return true;
 }
-EXPORT_SYMBOL_GPL(ljca_register_event_cb);
 
-void ljca_unregister_event_cb(struct platform_device *pdev)
+/*
+ * Like ljca_cmd_claim() for a timeout. A command written and given up on
+ * before USB_WRITE_ACK_TIMEOUT stays queued as a zombie, were its late ACK
+ * matched to the next command with the same cmd that one would get stale
+ * data. The caller adds the references of its place and its timer.
+ */
+static bool ljca_cmd_claim_timeout(struct ljca_cmd *tag)
 {
-	struct ljca_platform_data *ljca_pdata;
-	struct ljca_dev *ljca;
-	struct ljca_stub *stub;
-	unsigned long flags;
+	if (tag->finished)
+		return false;
+
+	tag->finished = true;
+	if (tag->wait_ack && tag->written &&
+	    ktime_ms_delta(ktime_get(), tag->start) < USB_WRITE_ACK_TIMEOUT) {
+		tag->zombie = true;
+		tag->ibuf = NULL;
+	} else {
+		list_del_init(&tag->list);
+	}
 
-	ljca = dev_get_drvdata(cur_dev);
-	ljca_pdata = dev_get_platdata(&pdev->dev);
-	stub = ljca_stub_find(ljca, ljca_pdata->type);
-	if (IS_ERR(stub))
-		return;
+	return true;
+}
 
-	spin_lock_irqsave(&stub->event_cb_lock, flags);
-	stub->event_entry.notify = NULL;
-	stub->event_entry.pdev = NULL;
-	spin_unlock_irqrestore(&stub->event_cb_lock, flags);
+/* must hold cmd_lock, the caller drops the reference of its place */
+static void ljca_cmd_bury(struct ljca_cmd *tag)
+{
+	tag->zombie = false;
+	list_del_init(&tag->list);
 }
-EXPORT_SYMBOL_GPL(ljca_unregister_event_cb);
 
-static void ljca_stub_cleanup(struct ljca_dev *ljca)
+/* a child command ended, the last one lets a waiting benchmark start */
+static void ljca_io_put(struct ljca_dev *ljca)
 {
-	struct ljca_stub *stub;
-	struct ljca_stub *next;
+	/* pairs with the barrier in ljca_bench_run() */
+	if (atomic_dec_and_test(&ljca->io_pending) &&
+	    READ_ONCE(ljca->bench_running))
+		wake_up(&ljca->io_wq);
+}
 
-	list_for_each_entry_safe (stub, next, &ljca->stubs_list, list) {
-		list_del_init(&stub->list);
-		kfree(stub);
-	}
+/* report a claimed command and drop the reference it held */
+static void ljca_cmd_complete(struct ljca_tx_buf *tx, int status)
+{
+	struct ljca_cmd *tag = &tx->tag;
+
+	tag->status = status;
+	if (tag->stub->type != DIAG_STUB)
+		ljca_io_put(tx->ljca);
+	atomic64_set(&tx->ljca->pm_last_busy, ktime_get_ns());
+	tx->ljca->ops->pm_put(tx->ljca);
+	if (tag->complete)
+		tag->complete(tag->context, status, tag->ibuf_len);
+	else
+		complete(&tag->done);
+
+	if (del_timer(&tag->timer))
+		ljca_tx_buf_unref(tx);
+
+	ljca_tx_buf_unref(tx);
 }
 
-static void ljca_read_complete(struct urb *urb)
+static bool ljca_cmd_finish(struct ljca_tx_buf *tx, int status)
 {
-	struct ljca_dev *ljca = urb->context;
-	struct ljca_msg *header = urb->transfer_buffer;
-	int len = urb->actual_length;
-	int ret;
+	struct ljca_stub *stub = tx->tag.stub;
+	unsigned long flags;
+	bool claimed;
 
-	dev_dbg(&ljca->intf->dev,
-		"bulk read urb got message from fw, status:%d data_len:%d\n",
-		urb->status, urb->actual_length);
+	spin_lock_irqsave(&stub->cmd_lock, flags);
+	claimed = ljca_cmd_claim(&tx->tag);
+	spin_unlock_irqrestore(&stub->cmd_lock, flags);
 
-	BUG_ON(!ljca);
-	BUG_ON(!header);
+	if (claimed)
+		ljca_cmd_complete(tx, status);
 
-	if (urb->status) {
-		/* sync/async unlink faults aren't errors */
-		if (urb->status == -ENOENT || urb->status == -ECONNRESET ||
-		    urb->status == -ESHUTDOWN)
-			return;
+	return claimed;
+}
 
-		dev_err(&ljca->intf->dev, "read bulk urb transfer failed: %d\n",
-			urb->status);
-		goto resubmit;
-	}
+/*
+ * Have the firmware coredump read in the background. Dumps not asked for
+ * by the user are rate limited, a wedged firmware keeps timing out.
+ */
+static void ljca_coredump_request(struct ljca_dev *ljca, bool forced)
+{
+	if (ljca->state == LJCA_STOPPED)
+		return;
 
-	dev_dbg(&ljca->intf->dev, "receive: type:%d cmd:%d flags:%d len:%d\n",
-		header->type, header->cmd, header->flags, header->len);
-	ljca_dump(ljca, header->data, header->len);
+	if (!forced && time_before(jiffies, READ_ONCE(ljca->coredump_next)))
+		return;
 
-	if (!ljca_validate(header, len)) {
-		dev_err(&ljca->intf->dev,
-			"data not correct header->len:%d payload_len:%d\n ",
-			header->len, len);
-		goto resubmit;
-	}
+	/* in echo mode the bridge would only hand the requests back */
+	if (READ_ONCE(ljca->bench_running))
+		return;
 
-	ret = ljca_parse(ljca, header);
-	if (ret)
-		dev_err(&ljca->intf->dev,
-			"failed to parse data: ret:%d type:%d len: %d", ret,
-			header->type, header->len);
+	queue_work(system_freezable_wq, &ljca->coredump_work);
+}
 
-resubmit:
-	ret = usb_submit_urb(urb, GFP_ATOMIC);
-	if (ret)
-		dev_err(&ljca->intf->dev,
-			"failed submitting read urb, error %d\n", ret);
+/* another child command timed out, enough of them in a row degrade the link */
+static void ljca_link_timeout(struct ljca_dev *ljca)
+{
+	if (!adaptive_rto ||
+	    atomic_inc_return(&ljca->timeouts_in_row) != LJCA_DEGRADED_TIMEOUTS)
+		return;
+
+	dev_warn(&ljca->intf->dev,
+		 "%d ACK timeouts in a row, link degraded\n",
+		 LJCA_DEGRADED_TIMEOUTS);
+	WRITE_ONCE(ljca->degraded, true);
+	if (ljca->state == LJCA_STOPPED)
+		return;
+
+	ljca->health_delay = LJCA_HEALTH_MIN_MS;
+	queue_delayed_work(system_freezable_wq, &ljca->health_work,
+			   msecs_to_jiffies(ljca->health_delay));
 }
 
-static int ljca_start(struct ljca_dev *ljca)
+/* count an ACK timeout, a burst of them asks for a coredump */
+static void ljca_timeout_storm(struct ljca_dev *ljca)
 {
-	int ret;
+	unsigned long flags;
+	bool storm;
 
-	usb_fill_bulk_urb(ljca->in_urb, ljca->udev,
-			  usb_rcvbulkpipe(ljca->udev, ljca->in_ep), ljca->ibuf,
-			  ljca->ibuf_len, ljca_read_complete, ljca);
+	spin_lock_irqsave(&ljca->storm_lock, flags);
+	if (time_after(jiffies, ljca->storm_start + LJCA_TIMEOUT_STORM_WINDOW)) {
+		ljca->storm_start = jiffies;
+		ljca->storm_count = 0;
+	}
+	storm = ++ljca->storm_count == LJCA_TIMEOUT_STORM;
+	spin_unlock_irqrestore(&ljca->storm_lock, flags);
 
-	ret = usb_submit_urb(ljca->in_urb, GFP_KERNEL);
-	if (ret) {
-		dev_err(&ljca->intf->dev,
-			"failed submitting read urb, error %d\n", ret);
+	if (storm) {
+		dev_warn(&ljca->intf->dev,
+			 "%d ACK timeouts in a row, reading the coredump\n",
+			 LJCA_TIMEOUT_STORM);
+		ljca_coredump_request(ljca, false);
 	}
-	return ret;
 }
 
-struct ljca_mng_priv {
-	long reset_id;
-};
-
-static int ljca_mng_reset_handshake(struct ljca_stub *stub)
+static void ljca_cmd_timeout(struct timer_list *t)
 {
-	int ret;
-	struct ljca_mng_priv *priv;
-	__le32 reset_id;
-	__le32 reset_id_ret = 0;
-	int ilen;
+	struct ljca_cmd *tag = from_timer(tag, t, timer);
+	struct ljca_tx_buf *tx = container_of(tag, struct ljca_tx_buf, tag);
+	struct ljca_stub *stub = tag->stub;
+	struct ljca_cmd_stats __percpu *stats = ljca_cmd_stats(stub, tag->cmd);
+	unsigned long flags;
+	bool claimed;
+	bool zombie;
+	s64 left;
+
+	spin_lock_irqsave(&stub->cmd_lock, flags);
+	if (tag->zombie) {
+		/* its ACK is not coming after all, drop its place and timer */
+		ljca_cmd_bury(tag);
+		spin_unlock_irqrestore(&stub->cmd_lock, flags);
+		ljca_tx_buf_unref(tx);
+		ljca_tx_buf_unref(tx);
+		return;
+	}
 
-	priv = ljca_priv(stub);
-	reset_id = cpu_to_le32(priv->reset_id++);
-	ret = ljca_stub_write(stub, MNG_RESET_NOTIFY, &reset_id,
-			      sizeof(reset_id), &reset_id_ret, &ilen, true,
-			      USB_WRITE_ACK_TIMEOUT);
-	if (ret || ilen != sizeof(reset_id_ret) || reset_id_ret != reset_id) {
-		dev_err(&stub->intf->dev,
-			"MNG_RESET_NOTIFY failed reset_id:%d/%d ret:%d\n",
-			le32_to_cpu(reset_id_ret), le32_to_cpu(reset_id), ret);
-		return -EIO;
+	claimed = ljca_cmd_claim_timeout(tag);
+	zombie = tag->zombie;
+	if (zombie)
+		refcount_add(2, &tx->ref);
+	spin_unlock_irqrestore(&stub->cmd_lock, flags);
+
+	/* a write stuck on the bus completes with -ECONNRESET */
+	tx->ljca->ops->cancel(tx);
+
+	if (claimed)
+		ljca_cmd_complete(tx, -ETIMEDOUT);
+
+	/* after ljca_cmd_complete(), which stops the timer */
+	if (zombie) {
+		left = USB_WRITE_ACK_TIMEOUT -
+		       ktime_ms_delta(ktime_get(), tag->start);
+		mod_timer(&tag->timer,
+			  jiffies + msecs_to_jiffies(max_t(s64, left, 1)));
 	}
 
-	return 0;
+	if (claimed && tag->wait_ack) {
+		this_cpu_inc(stats->timeouts);
+		trace_ljca_timeout(tx->ljca->udev, tag->stub->type, tag->cmd);
+		dev_err(&tx->ljca->intf->dev,
+			"ack wait timed out type:%d cmd:%d\n", tag->stub->type,
+			tag->cmd);
+		/* the dump's own commands do not count */
+		if (tag->stub->type != DIAG_STUB)
+			ljca_timeout_storm(tx->ljca);
+		ljca_rto_backoff(tag->stub, tag->cmd);
+		if (ljca_stub_is_child(tag->stub))
+			ljca_link_timeout(tx->ljca);
+	}
+
+	ljca_tx_buf_unref(tx);
 }
 
-static inline int ljca_mng_reset(struct ljca_stub *stub)
+/* the message of tx left, or failed to, drop its urb reference */
+static void ljca_cmd_written(struct ljca_tx_buf *tx, int status)
 {
-	return ljca_stub_write(stub, MNG_RESET, NULL, 0, NULL, NULL, true,
-			       USB_WRITE_ACK_TIMEOUT);
+	struct ljca_msg *header = tx->buf;
+	struct ljca_cmd *tag = &tx->tag;
+	struct ljca_cmd_stats __percpu *stats = ljca_cmd_stats(tag->stub,
+							       tag->cmd);
+
+	if (status) {
+		if (ljca_cmd_finish(tx, status))
+			dev_err(&tx->ljca->intf->dev,
+				"bridge write failed ret:%d type:%d cmd:%d\n",
+				status, tag->stub->type, tag->cmd);
+	} else {
+		WRITE_ONCE(tag->written, true);
+		this_cpu_inc(stats->sent);
+		this_cpu_add(stats->bytes_out, sizeof(*header) + header->len);
+		if (!tag->wait_ack)
+			ljca_cmd_finish(tx, 0);
+	}
+
+	ljca_tx_buf_unref(tx);
 }
 
-static int ljca_add_mfd_cell(struct ljca_dev *ljca, struct mfd_cell *cell)
+static void ljca_write_done(struct ljca_tx_buf *tx, int status)
 {
-	struct mfd_cell *new_cells;
+	struct ljca_tx_buf *packed;
+	struct ljca_tx_buf *next;
 
-	/* Enumerate the device even if it does not appear in DSDT */
-	if (!cell->acpi_match->pnpid)
-		dev_warn(&ljca->intf->dev,
-			 "The HID of cell %s does not exist in DSDT\n",
-			 cell->name);
+	list_for_each_entry_safe (packed, next, &tx->packed, pack_node) {
+		list_del_init(&packed->pack_node);
+		ljca_cmd_written(packed, status);
+	}
 
-	new_cells = krealloc_array(ljca->cells, (ljca->cell_count + 1),
-				   sizeof(struct mfd_cell), GFP_KERNEL);
-	if (!new_cells)
-		return -ENOMEM;
+	ljca_cmd_written(tx, status);
+}
 
-	memcpy(&new_cells[ljca->cell_count], cell, sizeof(*cell));
-	ljca->cells = new_cells;
-	ljca->cell_count++;
+static void ljca_write_complete(struct urb *urb)
+{
+	struct ljca_tx_buf *tx = urb->context;
+	int status = urb->status;
 
-	return 0;
+	if (!status && urb->actual_length != urb->transfer_buffer_length)
+		status = -EIO;
+
+	ljca_write_done(tx, status);
 }
 
-static int ljca_gpio_stub_init(struct ljca_dev *ljca,
-			       struct ljca_gpio_descriptor *desc)
+static int ljca_usb_send(struct ljca_tx_buf *tx)
 {
-	struct ljca_stub *stub;
-	struct mfd_cell cell = { 0 };
-	struct ljca_platform_data *pdata;
-	int gpio_num = desc->pins_per_bank * desc->bank_num;
-	int i;
-	u32 valid_pin[MAX_GPIO_NUM / (sizeof(u32) * BITS_PER_BYTE)];
+	tx->urb->transfer_buffer_length = tx->len;
+	return usb_submit_urb(tx->urb, GFP_KERNEL);
+}
 
-	if (gpio_num > MAX_GPIO_NUM)
-		return -EINVAL;
+static void ljca_usb_cancel(struct ljca_tx_buf *tx)
+{
+	usb_unlink_urb(tx->urb);
+}
 
-	stub = ljca_stub_alloc(ljca, sizeof(*pdata));
-	if (IS_ERR(stub))
-		return PTR_ERR(stub);
+static int ljca_usb_pm_get(struct ljca_dev *ljca)
+{
+	return usb_autopm_get_interface(ljca->intf);
+}
 
-	stub->type = GPIO_STUB;
-	stub->intf = ljca->intf;
+static void ljca_usb_pm_put(struct ljca_dev *ljca)
+{
+	usb_autopm_put_interface_async(ljca->intf);
+}
 
-	pdata = ljca_priv(stub);
-	pdata->type = stub->type;
-	pdata->gpio_info.num = gpio_num;
+static const struct ljca_transport_ops ljca_usb_ops = {
+	.send = ljca_usb_send,
+	.cancel = ljca_usb_cancel,
+	.pm_get = ljca_usb_pm_get,
+	.pm_put = ljca_usb_pm_put,
+};
 
-	for (i = 0; i < desc->bank_num; i++)
-		valid_pin[i] = desc->bank_desc[i].valid_pins;
+/* hand tx, with whatever was packed behind it, to the transport */
+static void ljca_cmd_send(struct ljca_tx_buf *tx)
+{
+	int ret;
 
-	bitmap_from_arr32(pdata->gpio_info.valid_pin_map, valid_pin, gpio_num);
+	refcount_inc(&tx->ref);
+	ret = tx->ljca->ops->send(tx);
+	if (ret)
+		ljca_write_done(tx, ret);
+}
 
-	cell.name = "ljca-gpio";
-	cell.platform_data = pdata;
-	cell.pdata_size = sizeof(*pdata);
-	cell.acpi_match = &ljca_acpi_match_gpio;
+/*
+ * A resume shortly after the bridge went idle means it was suspended in the
+ * middle of a burst, keep it awake longer. Idle gaps well beyond the delay
+ * let it fall back towards what it was at probe. A delay changed through
+ * sysfs is left alone and becomes the new base.
+ */
+static void ljca_pm_adapt(struct ljca_dev *ljca, s64 idle_ms)
+{
+	struct device *dev = &ljca->udev->dev;
+	int cur = READ_ONCE(dev->power.autosuspend_delay);
+	int delay;
 
-	return ljca_add_mfd_cell(ljca, &cell);
+	if (!autosuspend_max_ms || cur < 0)
+		return;
+
+	if (cur != ljca->pm_delay) {
+		ljca->pm_base_delay = cur;
+		ljca->pm_delay = cur;
+	}
+
+	if (idle_ms < 2 * (s64)cur + LJCA_PM_DELAY_STEP_MS)
+		delay = min_t(s64, max_t(s64, 2 * idle_ms,
+					 cur + LJCA_PM_DELAY_STEP_MS),
+			      autosuspend_max_ms);
+	else
+		delay = max(ljca->pm_base_delay, cur / 2);
+
+	if (delay <= ljca->pm_base_delay)
+		delay = ljca->pm_base_delay;
+	if (delay == cur)
+		return;
+
+	dev_dbg(&ljca->intf->dev, "autosuspend delay %d -> %d ms, idle %lld ms\n",
+		cur, delay, idle_ms);
+	ljca->pm_delay = delay;
+	pm_runtime_set_autosuspend_delay(dev, delay);
 }
 
-static int ljca_mng_enum_gpio(struct ljca_stub *stub)
+/* usb_autopm_get_interface(), accounting a resume it had to wait for */
+static int ljca_autopm_get(struct ljca_dev *ljca)
 {
-	struct ljca_dev *ljca = usb_get_intfdata(stub->intf);
-	struct ljca_gpio_descriptor *desc;
+	int resumes = atomic_read(&ljca->pm_resumes);
+	u64 start = ktime_get_ns();
+	u64 wait;
 	int ret;
-	int len;
 
-	desc = kzalloc(MAX_PAYLOAD_SIZE, GFP_KERNEL);
-	if (!desc)
-		return -ENOMEM;
+	ret = ljca->ops->pm_get(ljca);
+	if (ret || atomic_read(&ljca->pm_resumes) == resumes)
+		return ret;
 
-	ret = ljca_stub_write(stub, MNG_ENUM_GPIO, NULL, 0, desc, &len, true,
-			      USB_ENUM_STUB_TIMEOUT);
-	if (ret || len != sizeof(*desc) + desc->bank_num *
-						  sizeof(desc->bank_desc[0])) {
-		dev_err(&stub->intf->dev,
-			"enum gpio failed ret:%d len:%d bank_num:%d\n", ret,
-			len, desc->bank_num);
-		kfree(desc);
-		return -EIO;
+	wait = ktime_get_ns() - start;
+	mutex_lock(&ljca->pm_lock);
+	ljca->pm_stalls++;
+	ljca->pm_stall_ns += wait;
+	ljca->pm_stall_max_ns = max(ljca->pm_stall_max_ns, wait);
+	/* callers that waited for the same resume adapt once */
+	resumes = atomic_read(&ljca->pm_resumes);
+	if (ljca->pm_adapted != resumes) {
+		ljca->pm_adapted = resumes;
+		ljca_pm_adapt(ljca,
+			      div_u64(start - atomic64_read(&ljca->pm_last_busy),
+				      NSEC_PER_MSEC));
 	}
+	mutex_unlock(&ljca->pm_lock);
 
-	ret = ljca_gpio_stub_init(ljca, desc);
-	kfree(desc);
-	return ret;
+	return 0;
 }
 
-static int ljca_i2c_stub_init(struct ljca_dev *ljca,
-			      struct ljca_i2c_descriptor *desc)
+/*
+ * Fill in the header of the payload already placed in tx and queue its
+ * command, without sending it yet. Once this returned 0 the command ends
+ * exactly once, through tag->complete or tag->done.
+ */
+static int ljca_cmd_arm(struct ljca_stub *stub, struct ljca_tx_buf *tx,
+			u8 cmd, int obuf_len, bool wait_ack, int timeout)
 {
-	struct ljca_stub *stub;
-	struct ljca_platform_data *pdata;
-	int i;
+	struct ljca_dev *ljca = tx->ljca;
+	struct ljca_msg *header = tx->buf;
+	struct ljca_cmd *tag = &tx->tag;
+	unsigned long flags;
+	u8 msg_flags = CMPL_FLAG;
 	int ret;
 
-	stub = ljca_stub_alloc(ljca, desc->num * sizeof(*pdata));
-	if (IS_ERR(stub))
-		return PTR_ERR(stub);
+	if (ljca->state == LJCA_STOPPED)
+		return -ENODEV;
 
-	stub->type = I2C_STUB;
-	stub->intf = ljca->intf;
-	pdata = ljca_priv(stub);
+	if (obuf_len > ljca->max_payload)
+		return -EINVAL;
 
-	for (i = 0; i < desc->num; i++) {
-		struct mfd_cell cell = { 0 };
-		pdata[i].type = stub->type;
+	/* fail fast until the health probe heard from the bridge again */
+	if (READ_ONCE(ljca->degraded) && ljca_stub_is_child(stub))
+		return -ENOLINK;
 
-		pdata[i].i2c_info.id = desc->info[i].id;
-		pdata[i].i2c_info.capacity = desc->info[i].capacity;
-		pdata[i].i2c_info.intr_pin = desc->info[i].intr_pin;
+	if (wait_ack) {
+		msg_flags |= ACK_FLAG;
+		timeout = ljca_rto(stub, cmd, timeout);
+	}
 
-		cell.name = "ljca-i2c";
-		cell.platform_data = &pdata[i];
-		cell.pdata_size = sizeof(pdata[i]);
-		if (i < ARRAY_SIZE(ljca_acpi_match_i2cs))
-			cell.acpi_match = &ljca_acpi_match_i2cs[i];
+	header->type = stub->type;
+	header->cmd = cmd;
+	header->flags = msg_flags;
+	header->len = obuf_len;
 
-		ret = ljca_add_mfd_cell(ljca, &cell);
-		if (ret)
-			return ret;
+	/* counted before the check, ljca_bench_run() waits for the count */
+	if (stub->type != DIAG_STUB) {
+		atomic_inc(&ljca->io_pending);
+		smp_mb__after_atomic();
+		if (READ_ONCE(ljca->bench_running)) {
+			ljca_io_put(ljca);
+			return -EBUSY;
+		}
+	}
+
+	ret = ljca_autopm_get(ljca);
+	if (ret) {
+		if (stub->type != DIAG_STUB)
+			ljca_io_put(ljca);
+		return ret;
+	}
+
+	trace_ljca_send(ljca->udev, header->type, header->cmd, header->flags,
+			header->data, header->len);
+	ljca_capture(ljca, LJCA_CAPTURE_OUT, header);
+
+	tag->stub = stub;
+	tag->cmd = cmd;
+	tag->wait_ack = wait_ack;
+	tag->start = ktime_get();
+	tx->len = sizeof(*header) + obuf_len;
+	if (stub->type != DIAG_STUB)
+		atomic64_set(&ljca->io_last_ns, ktime_get_ns());
+
+	/* queue the tag before sending, the ACK may beat the write completion */
+	if (wait_ack) {
+		spin_lock_irqsave(&stub->cmd_lock, flags);
+		list_add_tail(&tag->list, &stub->pending);
+		spin_unlock_irqrestore(&stub->cmd_lock, flags);
 	}
 
+	/* one reference for the unfinished command, one for the timer */
+	refcount_add(2, &tx->ref);
+	mod_timer(&tag->timer,
+		  jiffies + msecs_to_jiffies(wait_ack ? timeout :
+							USB_WRITE_TIMEOUT));
+
 	return 0;
 }
 
-static int ljca_mng_enum_i2c(struct ljca_stub *stub)
+/*
+ * Send the payload already placed in tx. Once this returned 0 the command
+ * ends exactly once, through tag->complete or tag->done. The caller keeps
+ * its reference to tx either way.
+ */
+static int ljca_cmd_submit(struct ljca_stub *stub, struct ljca_tx_buf *tx,
+			   u8 cmd, int obuf_len, bool wait_ack, int timeout)
 {
-	struct ljca_dev *ljca = usb_get_intfdata(stub->intf);
-	struct ljca_i2c_descriptor *desc;
 	int ret;
-	int len;
-
-	desc = kzalloc(MAX_PAYLOAD_SIZE, GFP_KERNEL);
-	if (!desc)
-		return -ENOMEM;
 
-	ret = ljca_stub_write(stub, MNG_ENUM_I2C, NULL, 0, desc, &len, true,
-			      USB_ENUM_STUB_TIMEOUT);
-	if (ret) {
-		dev_err(&stub->intf->dev,
-			"MNG_ENUM_I2C failed ret:%d len:%d num:%d\n", ret, len,
-			desc->num);
-		kfree(desc);
-		return -EIO;
-	}
+	mutex_lock(&stub->submit_lock);
+	ret = ljca_cmd_arm(stub, tx, cmd, obuf_len, wait_ack, timeout);
+	if (!ret)
+		ljca_cmd_send(tx);
+	mutex_unlock(&stub->submit_lock);
 
-	ret = ljca_i2c_stub_init(ljca, desc);
-	kfree(desc);
 	return ret;
 }
 
-static int ljca_spi_stub_init(struct ljca_dev *ljca,
-			      struct ljca_spi_descriptor *desc)
+/* send the payload already placed in tx and wait, tx is released */
+static int ljca_stub_write_buf(struct ljca_stub *stub, u8 cmd,
+			       struct ljca_tx_buf *tx, int obuf_len, void *ibuf,
+			       int ibuf_size, int *ibuf_len, bool wait_ack,
+			       int timeout)
 {
-	struct ljca_stub *stub;
-	struct ljca_platform_data *pdata;
-	int i;
+	struct ljca_cmd *tag = &tx->tag;
 	int ret;
 
-	stub = ljca_stub_alloc(ljca, desc->num * sizeof(*pdata));
-	if (IS_ERR(stub))
-		return PTR_ERR(stub);
+	tag->ibuf = ibuf;
+	tag->ibuf_size = ibuf_size;
 
-	stub->type = SPI_STUB;
-	stub->intf = ljca->intf;
-	pdata = ljca_priv(stub);
+	mutex_lock(&stub->mutex);
+	ret = ljca_cmd_submit(stub, tx, cmd, obuf_len, wait_ack, timeout);
+	if (!ret) {
+		wait_for_completion(&tag->done);
+		ret = tag->status;
+	}
+	mutex_unlock(&stub->mutex);
 
-	for (i = 0; i < desc->num; i++) {
-		struct mfd_cell cell = { 0 };
-		pdata[i].type = stub->type;
+	if (!ret && ibuf_len)
+		*ibuf_len = tag->ibuf_len;
 
-		pdata[i].spi_info.id = desc->info[i].id;
-		pdata[i].spi_info.capacity = desc->info[i].capacity;
+	ljca_tx_buf_unref(tx);
+	return ret;
+}
 
-		cell.name = "ljca-spi";
-		cell.platform_data = &pdata[i];
-		cell.pdata_size = sizeof(pdata[i]);
-		if (i < ARRAY_SIZE(ljca_acpi_match_spis))
-			cell.acpi_match = &ljca_acpi_match_spis[i];
+static int ljca_stub_write(struct ljca_stub *stub, u8 cmd, const void *obuf,
+			   int obuf_len, void *ibuf, int ibuf_size,
+			   int *ibuf_len, bool wait_ack, int timeout)
+{
+	struct ljca_dev *ljca = usb_get_intfdata(stub->intf);
+	struct ljca_tx_buf *tx;
 
-		ret = ljca_add_mfd_cell(ljca, &cell);
-		if (ret)
-			return ret;
-	}
+	if (obuf_len > ljca->max_payload)
+		return -EINVAL;
 
-	return 0;
+	tx = ljca_tx_buf_alloc(ljca);
+	memcpy(tx->buf + sizeof(struct ljca_msg), obuf, obuf_len);
+
+	return ljca_stub_write_buf(stub, cmd, tx, obuf_len, ibuf, ibuf_size,
+				   ibuf_len, wait_ack, timeout);
 }
 
-static int ljca_mng_enum_spi(struct ljca_stub *stub)
+/* send the payload already placed in tx without waiting, tx is released */
+static int ljca_stub_write_buf_async(struct ljca_stub *stub, u8 cmd,
+				     struct ljca_tx_buf *tx, int obuf_len,
+				     void *ibuf, int ibuf_size,
+				     ljca_complete_cb_t complete,
+				     void *context)
 {
-	struct ljca_dev *ljca = usb_get_intfdata(stub->intf);
-	struct ljca_spi_descriptor *desc;
 	int ret;
-	int len;
 
-	desc = kzalloc(MAX_PAYLOAD_SIZE, GFP_KERNEL);
-	if (!desc)
-		return -ENOMEM;
-
-	ret = ljca_stub_write(stub, MNG_ENUM_SPI, NULL, 0, desc, &len, true,
-			      USB_ENUM_STUB_TIMEOUT);
-	if (ret) {
-		dev_err(&stub->intf->dev,
-			"MNG_ENUM_SPI failed ret:%d len:%d num:%d\n", ret, len,
-			desc->num);
-		kfree(desc);
-		return -EIO;
-	}
+	tx->tag.ibuf = ibuf;
+	tx->tag.ibuf_size = ibuf_size;
+	tx->tag.complete = complete;
+	tx->tag.context = context;
 
-	ret = ljca_spi_stub_init(ljca, desc);
-	kfree(desc);
+	ret = ljca_cmd_submit(stub, tx, cmd, obuf_len, true,
+			      USB_WRITE_ACK_TIMEOUT);
+	ljca_tx_buf_unref(tx);
 	return ret;
 }
 
-static int ljca_mng_get_version(struct ljca_stub *stub, char *buf)
+static int ljca_stub_write_async(struct ljca_stub *stub, u8 cmd,
+				 const void *obuf, int obuf_len, void *ibuf,
+				 int ibuf_size, ljca_complete_cb_t complete,
+				 void *context)
 {
-	struct fw_version version = { 0 };
-	int ret;
-	int len;
+	struct ljca_dev *ljca = usb_get_intfdata(stub->intf);
+	struct ljca_tx_buf *tx;
 
-	if (!buf)
+	if (obuf_len > ljca->max_payload)
 		return -EINVAL;
 
-	ret = ljca_stub_write(stub, MNG_GET_VERSION, NULL, 0, &version, &len,
-			      true, USB_WRITE_ACK_TIMEOUT);
-	if (ret || len < sizeof(struct fw_version)) {
-		dev_err(&stub->intf->dev,
-			"MNG_GET_VERSION failed ret:%d len:%d\n", ret, len);
-		return ret;
+	tx = ljca_tx_buf_alloc(ljca);
+	memcpy(tx->buf + sizeof(struct ljca_msg), obuf, obuf_len);
+
+	return ljca_stub_write_buf_async(stub, cmd, tx, obuf_len, ibuf,
+					 ibuf_size, complete, context);
+}
+
+/* hand an event to the stub's event_work, called in the read completion */
+static void ljca_event_queue(struct ljca_dev *ljca, struct ljca_stub *stub,
+			     struct ljca_msg *header, u64 ts)
+{
+	struct ljca_event_rec *rec = (struct ljca_event_rec *)stub->event_in;
+
+	rec->ts_ns = ts;
+	rec->cmd = header->cmd;
+	memcpy(rec->data, header->data, header->len);
+	if (!kfifo_in(&stub->events, stub->event_in,
+		      sizeof(*rec) + header->len)) {
+		atomic_inc(&ljca->rx_dropped);
+		dev_err_ratelimited(&ljca->intf->dev,
+				    "event queue full, type:%d cmd:%d dropped\n",
+				    header->type, header->cmd);
 	}
 
-	return sysfs_emit(buf, "%d.%d.%d.%d\n", version.major, version.minor,
-			  le16_to_cpu(version.patch),
-			  le16_to_cpu(version.build));
+	queue_work(system_highpri_wq, &stub->event_work);
 }
 
-static inline int ljca_mng_set_dfu_mode(struct ljca_stub *stub)
+static void ljca_event_work(struct work_struct *work)
 {
-	return ljca_stub_write(stub, MNG_SET_DFU_MODE, NULL, 0, NULL, NULL,
-			       true, USB_WRITE_ACK_TIMEOUT);
+	struct ljca_stub *stub =
+		container_of(work, struct ljca_stub, event_work);
+	struct ljca_dev *ljca = usb_get_intfdata(stub->intf);
+	struct ljca_event_rec *rec = (struct ljca_event_rec *)stub->event_out;
+	unsigned int len;
+
+	while ((len = kfifo_out(&stub->events, stub->event_out,
+				sizeof(stub->event_out)))) {
+		this_cpu_inc(ljca->stats->event_delay[ljca_lat_bucket(
+			div_u64(ktime_get_ns() - rec->ts_ns, NSEC_PER_USEC))]);
+
+		ljca_stub_notify(stub, rec->cmd, rec->data, len - sizeof(*rec));
+	}
 }
 
-static int ljca_mng_link(struct ljca_dev *ljca, struct ljca_stub *stub)
+/* the late ACK of a timed out command came, it still tells the round trip */
+static void ljca_zombie_ack(struct ljca_stub *stub, struct ljca_tx_buf *tx)
 {
-	int ret;
+	struct ljca_cmd *tag = &tx->tag;
+	struct ljca_cmd_stats __percpu *stats = ljca_cmd_stats(stub, tag->cmd);
+
+	this_cpu_inc(stats->late);
+	ljca_rto_update(stub, tag->cmd,
+			min_t(u64, ktime_us_delta(ktime_get(), tag->start),
+			      U32_MAX));
+	dev_dbg(&stub->intf->dev, "late ACK dropped type:%d cmd:%d\n",
+		stub->type, tag->cmd);
+
+	if (del_timer(&tag->timer))
+		ljca_tx_buf_unref(tx);
+	ljca_tx_buf_unref(tx);
+}
 
-	ret = ljca_mng_reset_handshake(stub);
-	if (ret)
-		return ret;
+static int ljca_parse(struct ljca_dev *ljca, struct ljca_msg *header, u64 ts)
+{
+	struct ljca_cmd_stats __percpu *stats;
+	struct ljca_stub *stub;
+	struct ljca_cmd *cmd;
+	unsigned long flags;
+	int status = 0;
+
+	if (header->type >= LJCA_NUM_STUBS)
+		return -ENODEV;
+
+	stub = rcu_dereference(ljca->stubs[header->type]);
+	if (!stub)
+		return -ENODEV;
+
+	if (!(header->flags & ACK_FLAG)) {
+		trace_ljca_event(ljca->udev, header->type, header->cmd,
+				 header->flags, header->data, header->len);
+		ljca_event_queue(ljca, stub, header, ts);
+		return 0;
+	}
+
+	spin_lock_irqsave(&stub->cmd_lock, flags);
+	cmd = ljca_cmd_find(stub, header->cmd);
+	if (!cmd) {
+		spin_unlock_irqrestore(&stub->cmd_lock, flags);
+		stats = ljca_cmd_stats(stub, header->cmd);
+		this_cpu_inc(stats->mismatches);
+		dev_err(&ljca->intf->dev,
+			"header->cmd:%x has no pending command, type:%d",
+			header->cmd, header->type);
+		return -EINVAL;
+	}
+
+	if (cmd->zombie) {
+		ljca_cmd_bury(cmd);
+		spin_unlock_irqrestore(&stub->cmd_lock, flags);
+		ljca_zombie_ack(stub, container_of(cmd, struct ljca_tx_buf, tag));
+		return 0;
+	}
+
+	cmd->ibuf_len = header->len;
+	if (cmd->ibuf && header->len > cmd->ibuf_size) {
+		status = -EMSGSIZE;
+		cmd->ibuf_len = 0;
+	} else if (cmd->ibuf) {
+		memcpy(cmd->ibuf, header->data, header->len);
+	}
+
+	cmd->acked = true;
+	ljca_cmd_claim(cmd);
+	spin_unlock_irqrestore(&stub->cmd_lock, flags);
+
+	trace_ljca_ack(ljca->udev, header->type, header->cmd, header->data,
+		       header->len, ktime_us_delta(ktime_get(), cmd->start));
+
+	ljca_stats_ack(stub, cmd->cmd, cmd->start, cmd->ibuf_len);
+	atomic_set(&ljca->timeouts_in_row, 0);
+	ljca_cmd_complete(container_of(cmd, struct ljca_tx_buf, tag), status);
+	this_cpu_inc(ljca->stats->ack_delay[ljca_lat_bucket(
+		div_u64(ktime_get_ns() - ts, NSEC_PER_USEC))]);
+
+	return 0;
+}
+
+static int ljca_transfer_internal(struct platform_device *pdev, u8 cmd,
+				  const void *obuf, int obuf_len, void *ibuf,
+				  int *ibuf_len, bool wait_ack)
+{
+	struct ljca_platform_data *ljca_pdata;
+	struct ljca_dev *ljca;
+	struct ljca_stub *stub;
+
+	if (!pdev)
+		return -EINVAL;
+
+	ljca = ljca_from_pdev(pdev);
+	ljca_pdata = dev_get_platdata(&pdev->dev);
+	stub = ljca_stub_find(ljca, ljca_pdata->type);
+	if (IS_ERR(stub))
+		return PTR_ERR(stub);
+
+	return ljca_stub_write(stub, cmd, obuf, obuf_len, ibuf,
+			       ljca->max_payload, ibuf_len, wait_ack,
+			       USB_WRITE_ACK_TIMEOUT);
+}
+
+int ljca_transfer(struct platform_device *pdev, u8 cmd, const void *obuf,
+		  int obuf_len, void *ibuf, int *ibuf_len)
+{
+	return ljca_transfer_internal(pdev, cmd, obuf, obuf_len, ibuf, ibuf_len,
+				      true);
+}
+EXPORT_SYMBOL_GPL(ljca_transfer);
+
+int ljca_transfer_noack(struct platform_device *pdev, u8 cmd, const void *obuf,
+			int obuf_len)
+{
+	return ljca_transfer_internal(pdev, cmd, obuf, obuf_len, NULL, NULL,
+				      false);
+}
+EXPORT_SYMBOL_GPL(ljca_transfer_noack);
+
+void *ljca_get_tx_buf(struct platform_device *pdev, int *len)
+{
+	struct ljca_dev *ljca;
+	struct ljca_tx_buf *tx;
+
+	if (!pdev)
+		return NULL;
+
+	ljca = ljca_from_pdev(pdev);
+	if (ljca->state == LJCA_STOPPED)
+		return NULL;
+
+	tx = ljca_tx_buf_alloc(ljca);
+	if (len)
+		*len = ljca->max_payload;
+
+	return tx->buf + sizeof(struct ljca_msg);
+}
+EXPORT_SYMBOL_GPL(ljca_get_tx_buf);
+
+void ljca_put_tx_buf(struct platform_device *pdev, void *buf)
+{
+	struct ljca_dev *ljca = ljca_from_pdev(pdev);
+	struct ljca_tx_buf *tx = ljca_tx_buf_lookup(ljca, buf);
+
+	if (!WARN_ON(!tx))
+		ljca_tx_buf_unref(tx);
+}
+EXPORT_SYMBOL_GPL(ljca_put_tx_buf);
+
+int ljca_transfer_tx_buf(struct platform_device *pdev, u8 cmd, void *obuf,
+			 int obuf_len, void *ibuf, int *ibuf_len)
+{
+	struct ljca_platform_data *ljca_pdata;
+	struct ljca_dev *ljca;
+	struct ljca_stub *stub;
+	struct ljca_tx_buf *tx;
+
+	ljca = ljca_from_pdev(pdev);
+	tx = ljca_tx_buf_lookup(ljca, obuf);
+	if (WARN_ON(!tx))
+		return -EINVAL;
+
+	ljca_pdata = dev_get_platdata(&pdev->dev);
+	stub = ljca_stub_find(ljca, ljca_pdata->type);
+	if (IS_ERR(stub)) {
+		ljca_tx_buf_unref(tx);
+		return PTR_ERR(stub);
+	}
+
+	return ljca_stub_write_buf(stub, cmd, tx, obuf_len, ibuf,
+				   ljca->max_payload, ibuf_len, true,
+				   USB_WRITE_ACK_TIMEOUT);
+}
+EXPORT_SYMBOL_GPL(ljca_transfer_tx_buf);
+
+int ljca_transfer_tx_buf_async(struct platform_device *pdev, u8 cmd,
+			       void *obuf, int obuf_len, void *ibuf,
+			       ljca_complete_cb_t complete, void *context)
+{
+	struct ljca_platform_data *ljca_pdata;
+	struct ljca_dev *ljca;
+	struct ljca_stub *stub;
+	struct ljca_tx_buf *tx;
+
+	ljca = ljca_from_pdev(pdev);
+	tx = ljca_tx_buf_lookup(ljca, obuf);
+	if (WARN_ON(!tx))
+		return -EINVAL;
+
+	ljca_pdata = dev_get_platdata(&pdev->dev);
+	stub = ljca_stub_find(ljca, ljca_pdata->type);
+	if (IS_ERR(stub) || !complete) {
+		ljca_tx_buf_unref(tx);
+		return IS_ERR(stub) ? PTR_ERR(stub) : -EINVAL;
+	}
+
+	return ljca_stub_write_buf_async(stub, cmd, tx, obuf_len, ibuf,
+					 ljca->max_payload, complete, context);
+}
+EXPORT_SYMBOL_GPL(ljca_transfer_tx_buf_async);
+
+int ljca_transfer_async(struct platform_device *pdev, u8 cmd,
+			const void *obuf, int obuf_len, void *ibuf,
+			ljca_complete_cb_t complete, void *context)
+{
+	struct ljca_platform_data *ljca_pdata;
+	struct ljca_dev *ljca;
+	struct ljca_stub *stub;
+
+	if (!pdev || !complete)
+		return -EINVAL;
+
+	ljca = ljca_from_pdev(pdev);
+	ljca_pdata = dev_get_platdata(&pdev->dev);
+	stub = ljca_stub_find(ljca, ljca_pdata->type);
+	if (IS_ERR(stub))
+		return PTR_ERR(stub);
+
+	return ljca_stub_write_async(stub, cmd, obuf, obuf_len, ibuf,
+				     ljca->max_payload, complete, context);
+}
+EXPORT_SYMBOL_GPL(ljca_transfer_async);
+
+/*
+ * A transfer being filled with the messages of a batch. The stub's
+ * submit_lock is held while there is a carrier, its messages are queued
+ * on pending already.
+ */
+struct ljca_packer {
+	struct ljca_stub *stub;
+	struct ljca_tx_buf *carrier;
+	int used;
+};
+
+static void ljca_pack_flush(struct ljca_packer *pk)
+{
+	if (!pk->carrier)
+		return;
+
+	pk->carrier->len = pk->used;
+	ljca_cmd_send(pk->carrier);
+	ljca_tx_buf_unref(pk->carrier);
+	pk->carrier = NULL;
+	mutex_unlock(&pk->stub->submit_lock);
+}
+
+/*
+ * Like ljca_stub_write_async(), but the message is copied behind the ones
+ * before it while they fit one frame. Waiting for a free buffer is only
+ * done with nothing held back and the stub's submit_lock released, so
+ * packers can't starve each other nor the senders holding a buffer.
+ */
+static int ljca_pack_async(struct ljca_packer *pk, struct ljca_stub *stub,
+			   u8 cmd, const void *obuf, int obuf_len, void *ibuf,
+			   ljca_complete_cb_t complete, void *context)
+{
+	struct ljca_dev *ljca = usb_get_intfdata(stub->intf);
+	int msg_len = sizeof(struct ljca_msg) + obuf_len;
+	struct ljca_tx_buf *tx = NULL;
+	int ret;
+
+	if (obuf_len > ljca->max_payload)
+		return -EINVAL;
+
+	if (pk->carrier && pk->used + msg_len <= ljca->frame_size)
+		tx = ljca_tx_buf_get(ljca);
+
+	if (!tx) {
+		ljca_pack_flush(pk);
+		tx = ljca_tx_buf_alloc(ljca);
+	}
+
+	memcpy(tx->buf + sizeof(struct ljca_msg), obuf, obuf_len);
+	tx->tag.ibuf = ibuf;
+	tx->tag.ibuf_size = ljca->max_payload;
+	tx->tag.complete = complete;
+	tx->tag.context = context;
+
+	/* a new carrier, nobody may send on the stub until it is flushed */
+	if (!pk->carrier) {
+		pk->stub = stub;
+		mutex_lock(&stub->submit_lock);
+	}
+
+	ret = ljca_cmd_arm(stub, tx, cmd, obuf_len, true,
+			   USB_WRITE_ACK_TIMEOUT);
+	if (ret) {
+		if (!pk->carrier)
+			mutex_unlock(&stub->submit_lock);
+		ljca_tx_buf_unref(tx);
+		return ret;
+	}
+
+	if (!pk->carrier) {
+		pk->carrier = tx;
+		pk->used = msg_len;
+		return 0;
+	}
+
+	memcpy(pk->carrier->buf + pk->used, tx->buf, msg_len);
+	pk->used += msg_len;
+
+	/* the reference of the urb it now travels in */
+	refcount_inc(&tx->ref);
+	list_add_tail(&tx->pack_node, &pk->carrier->packed);
+	ljca_tx_buf_unref(tx);
+	return 0;
+}
+
+struct ljca_batch;
+
+struct ljca_batch_entry {
+	struct ljca_batch *batch;
+	struct ljca_xfer *xfer;
+};
+
+struct ljca_batch {
+	/* one count per command plus one held while submitting */
+	atomic_t remaining;
+	int status;
+	ljca_batch_cb_t complete;
+	void *context;
+	struct ljca_batch_entry entries[];
+};
+
+static void ljca_batch_put(struct ljca_batch *batch)
+{
+	if (atomic_dec_and_test(&batch->remaining)) {
+		batch->complete(batch->context, batch->status);
+		kfree(batch);
+	}
+}
+
+static void ljca_batch_xfer_done(void *context, int status, int ibuf_len)
+{
+	struct ljca_batch_entry *entry = context;
+
+	entry->xfer->status = status;
+	entry->xfer->ibuf_len = ibuf_len;
+	if (status)
+		cmpxchg(&entry->batch->status, 0, status);
+
+	ljca_batch_put(entry->batch);
+}
+
+int ljca_transfer_batch(struct platform_device *pdev, struct ljca_xfer *xfers,
+			int num, ljca_batch_cb_t complete, void *context)
+{
+	struct ljca_platform_data *ljca_pdata;
+	struct ljca_packer pk = {};
+	struct ljca_batch *batch;
+	struct ljca_dev *ljca;
+	struct ljca_stub *stub;
+	int ret = 0;
+	int i;
+
+	if (!pdev || !complete || num <= 0)
+		return -EINVAL;
+
+	ljca = ljca_from_pdev(pdev);
+	ljca_pdata = dev_get_platdata(&pdev->dev);
+	stub = ljca_stub_find(ljca, ljca_pdata->type);
+	if (IS_ERR(stub))
+		return PTR_ERR(stub);
+
+	batch = kzalloc(struct_size(batch, entries, num), GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
+
+	atomic_set(&batch->remaining, num + 1);
+	batch->complete = complete;
+	batch->context = context;
+
+	for (i = 0; i < num; i++) {
+		batch->entries[i].batch = batch;
+		batch->entries[i].xfer = &xfers[i];
+		xfers[i].ibuf_len = 0;
+
+		/* once one command failed the rest are not sent */
+		if (!ret && tx_pack)
+			ret = ljca_pack_async(&pk, stub, xfers[i].cmd,
+					      xfers[i].obuf, xfers[i].obuf_len,
+					      xfers[i].ibuf,
+					      ljca_batch_xfer_done,
+					      &batch->entries[i]);
+		else if (!ret)
+			ret = ljca_stub_write_async(stub, xfers[i].cmd,
+						    xfers[i].obuf,
+						    xfers[i].obuf_len,
+						    xfers[i].ibuf,
+						    ljca->max_payload,
+						    ljca_batch_xfer_done,
+						    &batch->entries[i]);
+		if (!ret)
+			continue;
+
+		xfers[i].status = ret;
+		cmpxchg(&batch->status, 0, ret);
+		atomic_dec(&batch->remaining);
+	}
+
+	ljca_pack_flush(&pk);
+	ljca_batch_put(batch);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ljca_transfer_batch);
+
+int ljca_max_payload(struct platform_device *pdev)
+{
+	struct ljca_dev *ljca = ljca_from_pdev(pdev);
+
+	return ljca->max_payload;
+}
+EXPORT_SYMBOL_GPL(ljca_max_payload);
+
+int ljca_pm_get(struct platform_device *pdev)
+{
+	struct ljca_dev *ljca = ljca_from_pdev(pdev);
+
+	if (ljca->state == LJCA_STOPPED)
+		return -ENODEV;
+
+	return ljca_autopm_get(ljca);
+}
+EXPORT_SYMBOL_GPL(ljca_pm_get);
+
+void ljca_pm_put(struct platform_device *pdev)
+{
+	struct ljca_dev *ljca = ljca_from_pdev(pdev);
+
+	atomic64_set(&ljca->pm_last_busy, ktime_get_ns());
+	usb_autopm_put_interface(ljca->intf);
+}
+EXPORT_SYMBOL_GPL(ljca_pm_put);
+
+struct dentry *ljca_debugfs_dir(struct platform_device *pdev)
+{
+	struct ljca_dev *ljca = ljca_from_pdev(pdev);
+
+	return ljca->debugfs_dir;
+}
+EXPORT_SYMBOL_GPL(ljca_debugfs_dir);
+
+int ljca_register_event_cb(struct platform_device *pdev,
+			   ljca_event_cb_t event_cb)
+{
+	struct ljca_platform_data *ljca_pdata;
+	struct ljca_event_cb_entry *entry;
+	struct ljca_event_cb_entry *old;
+	struct ljca_dev *ljca;
+	struct ljca_stub *stub;
+
+	if (!pdev)
+		return -EINVAL;
+
+	ljca = ljca_from_pdev(pdev);
+	ljca_pdata = dev_get_platdata(&pdev->dev);
+	stub = ljca_stub_find(ljca, ljca_pdata->type);
+	if (IS_ERR(stub))
+		return PTR_ERR(stub);
+
+	entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		return -ENOMEM;
+
+	entry->notify = event_cb;
+	entry->pdev = pdev;
+
+	mutex_lock(&stub->event_cb_lock);
+	old = stub->event_entry;
+	stub->event_entry = entry;
+	mutex_unlock(&stub->event_cb_lock);
+
+	kfree(old);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ljca_register_event_cb);
+
+void ljca_unregister_event_cb(struct platform_device *pdev)
+{
+	struct ljca_platform_data *ljca_pdata;
+	struct ljca_event_cb_entry *old;
+	struct ljca_dev *ljca;
+	struct ljca_stub *stub;
+
+	ljca = ljca_from_pdev(pdev);
+	ljca_pdata = dev_get_platdata(&pdev->dev);
+	stub = ljca_stub_find(ljca, ljca_pdata->type);
+	if (IS_ERR(stub))
+		return;
+
+	/* waits for a callback still running on event_work */
+	mutex_lock(&stub->event_cb_lock);
+	old = stub->event_entry;
+	stub->event_entry = NULL;
+	mutex_unlock(&stub->event_cb_lock);
+
+	kfree(old);
+}
+EXPORT_SYMBOL_GPL(ljca_unregister_event_cb);
+
+static void ljca_stub_cleanup(struct ljca_dev *ljca)
+{
+	struct ljca_stub *stub;
+	struct ljca_stub *next;
+
+	list_for_each_entry (stub, &ljca->stubs_list, list)
+		RCU_INIT_POINTER(ljca->stubs[stub->type], NULL);
+
+	synchronize_rcu();
+
+	list_for_each_entry_safe (stub, next, &ljca->stubs_list, list) {
+		list_del_init(&stub->list);
+		cancel_work_sync(&stub->event_work);
+		kfifo_free(&stub->events);
+		kfree(stub->event_entry);
+		mutex_destroy(&stub->event_cb_lock);
+		mutex_destroy(&stub->mutex);
+		mutex_destroy(&stub->submit_lock);
+		free_percpu(stub->stats);
+		kfree(stub);
+	}
+}
+
+/* called in the read completion under rcu_read_lock(), ts is its time */
+static void ljca_rx_msgs(struct ljca_dev *ljca, u8 *buf, unsigned int len,
+			 u64 ts)
+{
+	struct ljca_msg *header;
+	unsigned int offset;
+	int ret;
+
+	/* the firmware may pack several messages into one transfer */
+	for (offset = 0; offset < len; offset += sizeof(*header) + header->len) {
+		header = (struct ljca_msg *)(buf + offset);
+		if (!ljca_validate(header, len - offset)) {
+			this_cpu_inc(ljca->stats->invalid);
+			dev_err(&ljca->intf->dev,
+				"data not correct header->len:%d payload_len:%d\n ",
+				len - offset >= sizeof(*header) ? header->len : 0,
+				len - offset);
+			break;
+		}
+
+		ljca_capture(ljca, LJCA_CAPTURE_IN, header);
+
+		ret = ljca_parse(ljca, header, ts);
+		if (ret)
+			dev_err(&ljca->intf->dev,
+				"failed to parse data: ret:%d type:%d len: %d",
+				ret, header->type, header->len);
+	}
+}
+
+static int ljca_submit_read(struct ljca_dev *ljca, struct urb *urb,
+			    gfp_t mem_flags)
+{
+	int ret;
+
+	usb_anchor_urb(urb, &ljca->rx_anchor);
+	ret = usb_submit_urb(urb, mem_flags);
+	if (ret) {
+		usb_unanchor_urb(urb);
+		dev_err(&ljca->intf->dev,
+			"failed submitting read urb, error %d\n", ret);
+		return ret;
+	}
+
+	atomic_inc(&ljca->rx_submitted);
+	return 0;
+}
+
+static void ljca_read_complete(struct urb *urb)
+{
+	struct ljca_dev *ljca = urb->context;
+
+	dev_dbg(&ljca->intf->dev,
+		"bulk read urb got message from fw, status:%d data_len:%d\n",
+		urb->status, urb->actual_length);
+
+	BUG_ON(!ljca);
+	BUG_ON(!urb->transfer_buffer);
+
+	if (atomic_dec_and_test(&ljca->rx_submitted))
+		atomic_inc(&ljca->rx_all_busy);
+
+	if (urb->status) {
+		/* sync/async unlink faults aren't errors */
+		if (urb->status == -ENOENT || urb->status == -ECONNRESET ||
+		    urb->status == -ESHUTDOWN)
+			return;
+
+		dev_err(&ljca->intf->dev, "read bulk urb transfer failed: %d\n",
+			urb->status);
+		goto resubmit;
+	}
+
+	/* ACKs wake their waiters right here, events are queued */
+	rcu_read_lock();
+	ljca_rx_msgs(ljca, urb->transfer_buffer, urb->actual_length,
+		     ktime_get_ns());
+	rcu_read_unlock();
+
+resubmit:
+	ljca_submit_read(ljca, urb, GFP_ATOMIC);
+}
+
+static int ljca_start(struct ljca_dev *ljca)
+{
+	int ret;
+	int i;
+
+	for (i = 0; i < ljca->in_urb_count; i++) {
+		ret = ljca_submit_read(ljca, ljca->in_urbs[i], GFP_KERNEL);
+		if (ret) {
+			usb_kill_anchored_urbs(&ljca->rx_anchor);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int ljca_rx_alloc(struct ljca_dev *ljca)
+{
+	unsigned int count = clamp_val(rx_urbs, 1, LJCA_MAX_RX_URBS);
+	struct urb *urb;
+	void *buf;
+	int i;
+
+	ljca->in_urbs = kcalloc(count, sizeof(*ljca->in_urbs), GFP_KERNEL);
+	if (!ljca->in_urbs)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb)
+			return -ENOMEM;
+
+		buf = kzalloc(ljca->ibuf_len, GFP_KERNEL);
+		if (!buf) {
+			usb_free_urb(urb);
+			return -ENOMEM;
+		}
+
+		usb_fill_bulk_urb(urb, ljca->udev,
+				  usb_rcvbulkpipe(ljca->udev, ljca->in_ep), buf,
+				  ljca->ibuf_len, ljca_read_complete, ljca);
+		urb->transfer_flags |= URB_FREE_BUFFER;
+		ljca->in_urbs[ljca->in_urb_count++] = urb;
+	}
+
+	return 0;
+}
+
+static void ljca_rx_free(struct ljca_dev *ljca)
+{
+	int i;
+
+	for (i = 0; i < ljca->in_urb_count; i++)
+		usb_free_urb(ljca->in_urbs[i]);
+
+	kfree(ljca->in_urbs);
+}
+
+struct ljca_mng_priv {
+	long reset_id;
+};
+
+static int ljca_mng_reset_handshake(struct ljca_stub *stub)
+{
+	int ret;
+	struct ljca_mng_priv *priv;
+	__le32 reset_id;
+	__le32 reset_id_ret = 0;
+	int ilen;
+
+	priv = ljca_priv(stub);
+	reset_id = cpu_to_le32(priv->reset_id++);
+	ret = ljca_stub_write(stub, MNG_RESET_NOTIFY, &reset_id,
+			      sizeof(reset_id), &reset_id_ret,
+			      sizeof(reset_id_ret), &ilen, true,
+			      USB_WRITE_ACK_TIMEOUT);
+	if (ret || ilen != sizeof(reset_id_ret) || reset_id_ret != reset_id) {
+		dev_err(&stub->intf->dev,
+			"MNG_RESET_NOTIFY failed reset_id:%d/%d ret:%d\n",
+			le32_to_cpu(reset_id_ret), le32_to_cpu(reset_id), ret);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static inline int ljca_mng_reset(struct ljca_stub *stub)
+{
+	return ljca_stub_write(stub, MNG_RESET, NULL, 0, NULL, 0, NULL, true,
+			       USB_WRITE_ACK_TIMEOUT);
+}
+
+static int ljca_add_mfd_cell(struct ljca_dev *ljca, struct mfd_cell *cell)
+{
+	struct mfd_cell *new_cells;
+
+	/* Enumerate the device even if it does not appear in DSDT */
+	if (!cell->acpi_match->pnpid)
+		dev_warn(&ljca->intf->dev,
+			 "The HID of cell %s does not exist in DSDT\n",
+			 cell->name);
+
+	new_cells = krealloc_array(ljca->cells, (ljca->cell_count + 1),
+				   sizeof(struct mfd_cell), GFP_KERNEL);
+	if (!new_cells)
+		return -ENOMEM;
+
+	memcpy(&new_cells[ljca->cell_count], cell, sizeof(*cell));
+	ljca->cells = new_cells;
+	ljca->cell_count++;
+
+	return 0;
+}
+
+static int ljca_remove_cell(struct device *dev, void *data)
+{
+	struct ljca_platform_data *pdata;
+	struct platform_device *pdev;
+
+	if (!dev_is_platform(dev))
+		return 0;
+
+	pdev = to_platform_device(dev);
+	if (!pdev->mfd_cell || strncmp(pdev->mfd_cell->name, "ljca-", 5))
+		return 0;
+
+	pdata = dev_get_platdata(dev);
+	if (!pdata || pdata->ljca != data)
+		return 0;
+
+	platform_device_unregister(pdev);
+	return 0;
+}
+
+/*
+ * sub_dev_parent may be an ancestor that other bridges add their cells to
+ * as well, so only the children carrying this bridge are removed.
+ */
+static void ljca_remove_cells(struct ljca_dev *ljca)
+{
+	device_for_each_child_reverse(ljca->sub_dev_parent, ljca,
+				      ljca_remove_cell);
+}
+
+static int ljca_add_cells(struct ljca_dev *ljca)
+{
+	int ret;
+	int i;
+
+	/* one at a time, a failed batch removes every child of the parent */
+	for (i = 0; i < ljca->cell_count; i++) {
+		ret = mfd_add_hotplug_devices(ljca->sub_dev_parent,
+					      &ljca->cells[i], 1);
+		if (ret) {
+			ljca_remove_cells(ljca);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int ljca_gpio_stub_init(struct ljca_dev *ljca,
+			       struct ljca_gpio_descriptor *desc)
+{
+	struct ljca_stub *stub;
+	struct mfd_cell cell = { 0 };
+	struct ljca_platform_data *pdata;
+	int gpio_num = desc->pins_per_bank * desc->bank_num;
+	int i;
+	u32 valid_pin[MAX_GPIO_NUM / (sizeof(u32) * BITS_PER_BYTE)];
+
+	if (gpio_num > MAX_GPIO_NUM)
+		return -EINVAL;
+
+	stub = ljca_stub_alloc(ljca, GPIO_STUB, sizeof(*pdata));
+	if (IS_ERR(stub))
+		return PTR_ERR(stub);
+
+
+	pdata = ljca_priv(stub);
+	pdata->type = stub->type;
+	pdata->ljca = ljca;
+	pdata->gpio_info.num = gpio_num;
+
+	for (i = 0; i < desc->bank_num; i++)
+		valid_pin[i] = desc->bank_desc[i].valid_pins;
+
+	bitmap_from_arr32(pdata->gpio_info.valid_pin_map, valid_pin, gpio_num);
+
+	cell.name = "ljca-gpio";
+	cell.platform_data = pdata;
+	cell.pdata_size = sizeof(*pdata);
+	cell.acpi_match = &ljca->acpi_match_gpio;
+
+	return ljca_add_mfd_cell(ljca, &cell);
+}
+
+static int ljca_i2c_stub_init(struct ljca_dev *ljca,
+			      struct ljca_i2c_descriptor *desc)
+{
+	struct ljca_stub *stub;
+	struct ljca_platform_data *pdata;
+	int i;
+	int ret;
+
+	stub = ljca_stub_alloc(ljca, I2C_STUB, desc->num * sizeof(*pdata));
+	if (IS_ERR(stub))
+		return PTR_ERR(stub);
+
+	pdata = ljca_priv(stub);
+
+	for (i = 0; i < desc->num; i++) {
+		struct mfd_cell cell = { 0 };
+		pdata[i].type = stub->type;
+		pdata[i].ljca = ljca;
+
+		pdata[i].i2c_info.id = desc->info[i].id;
+		pdata[i].i2c_info.capacity = desc->info[i].capacity;
+		pdata[i].i2c_info.intr_pin = desc->info[i].intr_pin;
+
+		cell.name = "ljca-i2c";
+		cell.platform_data = &pdata[i];
+		cell.pdata_size = sizeof(pdata[i]);
+		if (i < ARRAY_SIZE(ljca->acpi_match_i2cs))
+			cell.acpi_match = &ljca->acpi_match_i2cs[i];
+
+		ret = ljca_add_mfd_cell(ljca, &cell);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int ljca_spi_stub_init(struct ljca_dev *ljca,
+			      struct ljca_spi_descriptor *desc)
+{
+	struct ljca_stub *stub;
+	struct ljca_platform_data *pdata;
+	int i;
+	int ret;
+
+	stub = ljca_stub_alloc(ljca, SPI_STUB, desc->num * sizeof(*pdata));
+	if (IS_ERR(stub))
+		return PTR_ERR(stub);
+
+	pdata = ljca_priv(stub);
+
+	for (i = 0; i < desc->num; i++) {
+		struct mfd_cell cell = { 0 };
+		pdata[i].type = stub->type;
+		pdata[i].ljca = ljca;
+
+		pdata[i].spi_info.id = desc->info[i].id;
+		pdata[i].spi_info.capacity = desc->info[i].capacity;
+
+		cell.name = "ljca-spi";
+		cell.platform_data = &pdata[i];
+		cell.pdata_size = sizeof(pdata[i]);
+		if (i < ARRAY_SIZE(ljca->acpi_match_spis))
+			cell.acpi_match = &ljca->acpi_match_spis[i];
+
+		ret = ljca_add_mfd_cell(ljca, &cell);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int ljca_mng_read_version(struct ljca_stub *stub,
+				 struct fw_version *version)
+{
+	int ret;
+	int len;
+
+	ret = ljca_stub_write(stub, MNG_GET_VERSION, NULL, 0, version,
+			      sizeof(*version), &len, true,
+			      USB_WRITE_ACK_TIMEOUT);
+	if (ret || len < sizeof(struct fw_version)) {
+		dev_err(&stub->intf->dev,
+			"MNG_GET_VERSION failed ret:%d len:%d\n", ret, len);
+		return ret ? ret : -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * The link was marked degraded, poll the bridge with backoff until it
+ * answers again and let the children's commands through from then on.
+ */
+static void ljca_health_work(struct work_struct *work)
+{
+	struct ljca_dev *ljca =
+		container_of(to_delayed_work(work), struct ljca_dev, health_work);
+	struct ljca_stub *stub = ljca_stub_find(ljca, MNG_STUB);
+	struct fw_version version;
+
+	if (IS_ERR(stub) || ljca->state == LJCA_STOPPED)
+		return;
+
+	if (!ljca_mng_read_version(stub, &version)) {
+		atomic_set(&ljca->timeouts_in_row, 0);
+		WRITE_ONCE(ljca->degraded, false);
+		dev_info(&ljca->intf->dev, "link recovered\n");
+		return;
+	}
+
+	ljca->health_delay = min(ljca->health_delay * 2,
+				 (unsigned int)LJCA_HEALTH_MAX_MS);
+	queue_delayed_work(system_freezable_wq, &ljca->health_work,
+			   msecs_to_jiffies(ljca->health_delay));
+}
+
+static int ljca_mng_get_version(struct ljca_stub *stub, char *buf)
+{
+	struct fw_version version = { 0 };
+	int ret;
+
+	if (!buf)
+		return -EINVAL;
+
+	ret = ljca_mng_read_version(stub, &version);
+	if (ret)
+		return ret;
+
+	return sysfs_emit(buf, "%d.%d.%d.%d\n", version.major, version.minor,
+			  le16_to_cpu(version.patch),
+			  le16_to_cpu(version.build));
+}
+
+static inline int ljca_mng_set_dfu_mode(struct ljca_stub *stub)
+{
+	return ljca_stub_write(stub, MNG_SET_DFU_MODE, NULL, 0, NULL, 0, NULL,
+			       true, USB_WRITE_ACK_TIMEOUT);
+}
+
+static const u8 ljca_enum_cmds[LJCA_ENUM_NUM] = {
+	[LJCA_ENUM_GPIO] = MNG_ENUM_GPIO,
+	[LJCA_ENUM_I2C] = MNG_ENUM_I2C,
+	[LJCA_ENUM_SPI] = MNG_ENUM_SPI,
+};
+
+static bool ljca_enum_valid(int type, const void *buf, int len)
+{
+	const struct ljca_gpio_descriptor *gpio = buf;
+	const struct ljca_i2c_descriptor *i2c = buf;
+	const struct ljca_spi_descriptor *spi = buf;
+
+	switch (type) {
+	case LJCA_ENUM_GPIO:
+		return len >= sizeof(*gpio) &&
+		       gpio->bank_num <=
+			       MAX_GPIO_NUM / (sizeof(u32) * BITS_PER_BYTE) &&
+		       len == struct_size(gpio, bank_desc, gpio->bank_num);
+	case LJCA_ENUM_I2C:
+		return len >= sizeof(*i2c) &&
+		       len >= struct_size(i2c, info, i2c->num);
+	case LJCA_ENUM_SPI:
+		return len >= sizeof(*spi) &&
+		       len >= struct_size(spi, info, spi->num);
+	}
+
+	return false;
+}
+
+/* read and check one descriptor, a failed one is left empty */
+static int ljca_mng_enum(struct ljca_stub *stub, struct ljca_enum *e,
+			 int type)
+{
+	int ret;
+	int len = 0;
+
+	e->len[type] = 0;
+	ret = ljca_stub_write(stub, ljca_enum_cmds[type], NULL, 0,
+			      e->desc[type], sizeof(e->desc[type]), &len, true,
+			      USB_ENUM_STUB_TIMEOUT);
+	if (ret || !ljca_enum_valid(type, e->desc[type], len)) {
+		dev_err(&stub->intf->dev, "enum cmd:%d failed ret:%d len:%d\n",
+			ljca_enum_cmds[type], ret, len);
+		return -EIO;
+	}
+
+	e->len[type] = len;
+	return 0;
+}
+
+static void ljca_enum_key(struct ljca_dev *ljca, struct ljca_enum *e)
+{
+	e->version = ljca->fw_version;
+	/* the devpath alone repeats across buses, the device name does not */
+	strscpy(e->port, dev_name(&ljca->udev->dev), sizeof(e->port));
+}
+
+/* must hold ljca_enum_lock */
+static struct ljca_enum *ljca_enum_cache_find(const struct ljca_enum *key)
+{
+	struct ljca_enum *e;
+
+	list_for_each_entry (e, &ljca_enum_cache, list) {
+		if (!memcmp(&e->version, &key->version, sizeof(e->version)) &&
+		    !strcmp(e->port, key->port))
+			return e;
+	}
+
+	return NULL;
+}
+
+/* copy the cached descriptors matching the key of e into e */
+static bool ljca_enum_cache_get(struct ljca_enum *e)
+{
+	struct ljca_enum *cached;
+
+	mutex_lock(&ljca_enum_lock);
+	cached = ljca_enum_cache_find(e);
+	if (cached) {
+		memcpy(e->len, cached->len, sizeof(e->len));
+		memcpy(e->desc, cached->desc, sizeof(e->desc));
+	}
+	mutex_unlock(&ljca_enum_lock);
+
+	return cached != NULL;
+}
+
+static void ljca_enum_cache_put(const struct ljca_enum *e)
+{
+	struct ljca_enum *cached;
+
+	mutex_lock(&ljca_enum_lock);
+	cached = ljca_enum_cache_find(e);
+	if (!cached) {
+		cached = kmalloc(sizeof(*cached), GFP_KERNEL);
+		if (!cached)
+			goto out;
+
+		if (ljca_enum_count == LJCA_ENUM_CACHE_MAX) {
+			struct ljca_enum *old = list_last_entry(
+				&ljca_enum_cache, struct ljca_enum, list);
+
+			list_del(&old->list);
+			kfree(old);
+		} else {
+			ljca_enum_count++;
+		}
+	} else {
+		list_del(&cached->list);
+	}
+
+	memcpy(cached, e, sizeof(*cached));
+	list_add(&cached->list, &ljca_enum_cache);
+out:
+	mutex_unlock(&ljca_enum_lock);
+}
+
+static void ljca_enum_cache_free(void)
+{
+	struct ljca_enum *e, *next;
+
+	list_for_each_entry_safe (e, next, &ljca_enum_cache, list)
+		kfree(e);
+}
+
+static void ljca_enum_stubs_init(struct ljca_dev *ljca, struct ljca_enum *e)
+{
+	/* workaround for FW limitation, ignore return value of enum result */
+	if (e->len[LJCA_ENUM_GPIO])
+		ljca_gpio_stub_init(ljca, (void *)e->desc[LJCA_ENUM_GPIO]);
+	ljca->state = LJCA_ENUM_GPIO_COMPLETE;
+
+	if (e->len[LJCA_ENUM_I2C])
+		ljca_i2c_stub_init(ljca, (void *)e->desc[LJCA_ENUM_I2C]);
+	ljca->state = LJCA_ENUM_I2C_COMPLETE;
+
+	if (e->len[LJCA_ENUM_SPI])
+		ljca_spi_stub_init(ljca, (void *)e->desc[LJCA_ENUM_SPI]);
+	ljca->state = LJCA_ENUM_SPI_COMPLETE;
+}
+
+/*
+ * Children were added from the cache, check it against the bridge. A
+ * descriptor that reads back different replaces the cached one and the
+ * device is reset, so the next probe builds the children from it.
+ */
+static void ljca_enum_confirm_work(struct work_struct *work)
+{
+	struct ljca_dev *ljca = container_of(work, struct ljca_dev, enum_work);
+	struct ljca_stub *stub = ljca_stub_find(ljca, MNG_STUB);
+	struct ljca_enum *cached;
+	struct ljca_enum *live;
+	bool changed = false;
+	int i;
+
+	cached = kzalloc(sizeof(*cached), GFP_KERNEL);
+	live = kzalloc(sizeof(*live), GFP_KERNEL);
+	if (!cached || !live || IS_ERR(stub))
+		goto out;
+
+	ljca_enum_key(ljca, cached);
+	ljca_enum_key(ljca, live);
+	if (!ljca_enum_cache_get(cached) || ljca_autopm_get(ljca))
+		goto out;
+
+	for (i = 0; i < LJCA_ENUM_NUM; i++) {
+		/* a failed read confirms nothing, keep what was cached */
+		if (ljca_mng_enum(stub, live, i)) {
+			live->len[i] = cached->len[i];
+			memcpy(live->desc[i], cached->desc[i], cached->len[i]);
+			continue;
+		}
+
+		if (live->len[i] != cached->len[i] ||
+		    memcmp(live->desc[i], cached->desc[i], live->len[i]))
+			changed = true;
+	}
+	usb_autopm_put_interface(ljca->intf);
+
+	if (!changed) {
+		dev_dbg(&ljca->intf->dev, "cached enumeration confirmed\n");
+		goto out;
+	}
+
+	dev_warn(&ljca->intf->dev,
+		 "enumeration differs from the cached one, resetting\n");
+	ljca_enum_cache_put(live);
+	usb_queue_reset_device(ljca->intf);
+out:
+	kfree(live);
+	kfree(cached);
+}
+
+static int ljca_mng_link(struct ljca_dev *ljca, struct ljca_stub *stub)
+{
+	struct ljca_enum *e;
+	int ret;
+	int i;
+
+	ret = ljca_mng_reset_handshake(stub);
+	if (ret)
+		return ret;
+
+	ljca->state = LJCA_RESET_SYNCED;
+
+	e = kzalloc(sizeof(*e), GFP_KERNEL);
+	if (!e)
+		return -ENOMEM;
+
+	/* the cache is keyed by the firmware version, no version no cache */
+	if (enum_cache &&
+	    !ljca_mng_read_version(stub, &ljca->fw_version)) {
+		ljca_enum_key(ljca, e);
+		ljca->enum_cached = ljca_enum_cache_get(e);
+	}
+
+	if (!ljca->enum_cached) {
+		for (i = 0; i < LJCA_ENUM_NUM; i++)
+			ljca_mng_enum(stub, e, i);
+
+		if (e->port[0])
+			ljca_enum_cache_put(e);
+	}
+
+	ljca_enum_stubs_init(ljca, e);
+	kfree(e);
+
+	return 0;
+}
+
+static int ljca_mng_init(struct ljca_dev *ljca)
+{
+	struct ljca_stub *stub;
+	struct ljca_mng_priv *priv;
+	int ret;
+
+	stub = ljca_stub_alloc(ljca, MNG_STUB, sizeof(*priv));
+	if (IS_ERR(stub))
+		return PTR_ERR(stub);
+
+	priv = ljca_priv(stub);
+	if (!priv)
+		return -ENOMEM;
+
+	priv->reset_id = 0;
+
+	ret = ljca_mng_link(ljca, stub);
+	if (ret)
+		dev_err(&ljca->intf->dev,
+			"mng stub link done ret:%d state:%d\n", ret,
+			ljca->state);
+
+	return ret;
+}
+
+static inline int ljca_diag_get_fw_log(struct ljca_stub *stub, void *buf)
+{
+	struct ljca_dev *ljca = usb_get_intfdata(stub->intf);
+	int ret;
+	int len;
+
+	if (!buf)
+		return -EINVAL;
+
+	ret = ljca_stub_write(stub, DIAG_GET_FW_LOG, NULL, 0, buf,
+			      ljca->max_payload, &len, true,
+			      USB_WRITE_ACK_TIMEOUT);
+	if (ret)
+		return ret;
+
+	return len;
+}
+
+static inline int ljca_diag_get_coredump(struct ljca_stub *stub, void *buf)
+{
+	struct ljca_dev *ljca = usb_get_intfdata(stub->intf);
+	int ret;
+	int len;
+
+	if (!buf)
+		return -EINVAL;
+
+	ret = ljca_stub_write(stub, DIAG_GET_FW_COREDUMP, NULL, 0, buf,
+			      ljca->max_payload, &len, true,
+			      USB_WRITE_ACK_TIMEOUT);
+	if (ret)
+		return ret;
+
+	return len;
+}
+
+/*
+ * Every DIAG_GET_FW_COREDUMP returns the next chunk of the dump, a chunk
+ * shorter than a full payload is the last one. The dump is handed to
+ * devcoredump, which frees it.
+ */
+static void ljca_coredump_work(struct work_struct *work)
+{
+	struct ljca_dev *ljca =
+		container_of(work, struct ljca_dev, coredump_work);
+	struct ljca_stub *stub = ljca_stub_find(ljca, DIAG_STUB);
+	size_t size = 0;
+	void *dump;
+	int len;
+
+	if (IS_ERR(stub))
+		return;
+
+	dump = vmalloc(LJCA_COREDUMP_SIZE);
+	if (!dump)
+		return;
+
+	do {
+		if (ljca->state == LJCA_STOPPED)
+			break;
+
+		len = ljca_diag_get_coredump(stub, dump + size);
+		if (len < 0) {
+			dev_err(&ljca->intf->dev,
+				"coredump read failed at %zu ret:%d\n", size,
+				len);
+			break;
+		}
+
+		size += len;
+	} while (len == ljca->max_payload &&
+		 size + ljca->max_payload <= LJCA_COREDUMP_SIZE);
+
+	WRITE_ONCE(ljca->coredump_next, jiffies + LJCA_COREDUMP_INTERVAL);
+	if (!size) {
+		vfree(dump);
+		return;
+	}
+
+	dev_info(&ljca->intf->dev, "firmware coredump of %zu bytes taken\n",
+		 size);
+	dev_coredumpv(&ljca->intf->dev, dump, size, GFP_KERNEL);
+}
+
+static inline int ljca_diag_set_echo_mode(struct ljca_stub *stub, u8 on)
+{
+	return ljca_stub_write(stub, DIAG_SET_ECHO_MODE, &on, sizeof(on), NULL,
+			       0, NULL, true, USB_WRITE_ACK_TIMEOUT);
+}
+
+static inline int ljca_diag_set_trace_level(struct ljca_stub *stub, u8 level)
+{
+	return ljca_stub_write(stub, DIAG_SET_TRACE_LEVEL, &level,
+			       sizeof(level), NULL, 0, NULL, true,
+			       USB_WRITE_ACK_TIMEOUT);
+}
+
+/* whether the children use the bridge, or just did, or a benchmark runs */
+static bool ljca_io_busy(struct ljca_dev *ljca)
+{
+	return atomic_read(&ljca->io_pending) ||
+	       READ_ONCE(ljca->bench_running) ||
+	       ktime_get_ns() - atomic64_read(&ljca->io_last_ns) <
+		       LJCA_FW_LOG_QUIET_NS;
+}
+
+/*
+ * Drain the firmware log into the ring. Polling backs off while the log
+ * stays empty and speeds up while it has data. It steps aside while the
+ * children use the bridge, and pauses once they left it idle so that it
+ * can autosuspend. What the firmware logs meanwhile is read on the next
+ * burst of child I/O.
+ */
+static void ljca_fw_log_work(struct work_struct *work)
+{
+	struct ljca_dev *ljca =
+		container_of(to_delayed_work(work), struct ljca_dev, fw_log_work);
+	struct ljca_stub *stub = ljca_stub_find(ljca, DIAG_STUB);
+	unsigned int delay = LJCA_FW_LOG_MIN_MS;
+	unsigned int copied;
+	int len;
+
+	if (IS_ERR(stub) || ljca->state == LJCA_STOPPED)
+		return;
+
+	if (ljca_io_busy(ljca) || pm_runtime_suspended(&ljca->intf->dev))
+		goto out;
+
+	if (ktime_get_ns() - atomic64_read(&ljca->io_last_ns) >
+	    LJCA_FW_LOG_IDLE_NS) {
+		delay = LJCA_FW_LOG_MAX_MS;
+		goto out;
+	}
+
+	len = ljca_diag_get_fw_log(stub, ljca->fw_log_buf);
+	if (len > 0) {
+		copied = kfifo_in(&ljca->fw_log, ljca->fw_log_buf, len);
+		ljca->fw_log_bytes += copied;
+		ljca->fw_log_dropped += len - copied;
+		wake_up_interruptible(&ljca->fw_log_wq);
+
+		ljca->fw_log_interval = max(ljca->fw_log_interval / 4,
+					    (unsigned int)LJCA_FW_LOG_MIN_MS);
+	} else {
+		ljca->fw_log_interval = min(ljca->fw_log_interval * 2,
+					    (unsigned int)LJCA_FW_LOG_MAX_MS);
+	}
+
+	/* a full payload likely has more behind it */
+	delay = len == ljca->max_payload ? 0 : ljca->fw_log_interval;
+out:
+	queue_delayed_work(system_freezable_wq, &ljca->fw_log_work,
+			   msecs_to_jiffies(delay));
+}
+
+static int ljca_fw_log_init(struct ljca_dev *ljca)
+{
+	int ret;
+
+	ret = kfifo_alloc(&ljca->fw_log, LJCA_FW_LOG_SIZE, GFP_KERNEL);
+	if (ret)
+		return ret;
+
+	ljca->fw_log_buf = kmalloc(ljca->max_payload, GFP_KERNEL);
+	if (!ljca->fw_log_buf)
+		return -ENOMEM;
+
+	ljca->fw_log_interval = LJCA_FW_LOG_MAX_MS;
+	return 0;
+}
+
+/*
+ * Read DIAG_GET_STATE and DIAG_GET_STATISTIC, keeping the previous sample
+ * for deltas. The statistics are taken as an array of little-endian u32
+ * counters, the state as opaque bytes.
+ */
+static void ljca_fw_stats_sample(struct ljca_dev *ljca)
+{
+	struct ljca_stub *stub = ljca_stub_find(ljca, DIAG_STUB);
+	int ret;
+	int len;
+	int i;
+
+	if (IS_ERR(stub))
+		return;
+
+	mutex_lock(&ljca->fw_stats_lock);
+	if (ljca->fw_stats_ns &&
+	    ktime_get_ns() - ljca->fw_stats_ns < LJCA_FW_STATS_MIN_NS)
+		goto out;
+
+	ret = ljca_stub_write(stub, DIAG_GET_STATE, NULL, 0, ljca->fw_state,
+			      sizeof(ljca->fw_state), &len, true,
+			      USB_WRITE_ACK_TIMEOUT);
+	ljca->fw_state_len = ret ? 0 : len;
+
+	ret = ljca_stub_write(stub, DIAG_GET_STATISTIC, NULL, 0,
+			      ljca->fw_stats_buf, sizeof(ljca->fw_stats_buf),
+			      &len, true, USB_WRITE_ACK_TIMEOUT);
+	if (ret) {
+		dev_dbg(&ljca->intf->dev, "DIAG_GET_STATISTIC failed ret:%d\n",
+			ret);
+		goto out;
+	}
+
+	memcpy(ljca->fw_stats_prev, ljca->fw_stats,
+	       sizeof(ljca->fw_stats_prev));
+	ljca->fw_stats_prev_ns = ljca->fw_stats_ns;
+	ljca->fw_stats_num = len / sizeof(u32);
+	for (i = 0; i < ljca->fw_stats_num; i++) {
+		__le32 v;
+
+		memcpy(&v, ljca->fw_stats_buf + i * sizeof(v), sizeof(v));
+		ljca->fw_stats[i] = le32_to_cpu(v);
+	}
+	ljca->fw_stats_ns = ktime_get_ns();
+out:
+	mutex_unlock(&ljca->fw_stats_lock);
+}
+
+/* the periodic sampler, it keeps out of the way like the log collector */
+static void ljca_fw_stats_work(struct work_struct *work)
+{
+	struct ljca_dev *ljca =
+		container_of(to_delayed_work(work), struct ljca_dev, fw_stats_work);
+
+	if (ljca->state == LJCA_STOPPED)
+		return;
+
+	if (!ljca_io_busy(ljca) && !pm_runtime_suspended(&ljca->intf->dev))
+		ljca_fw_stats_sample(ljca);
+
+	queue_delayed_work(system_freezable_wq, &ljca->fw_stats_work,
+			   msecs_to_jiffies(max(fw_stats_ms, 1000U)));
+}
+
+#define LJCA_BENCH_MAX_COUNT 100000
+/* how long children may be kept off the bridge, draining it included */
+#define LJCA_BENCH_MAX_MS 1000
+
+struct ljca_bench;
+
+struct ljca_bench_slot {
+	struct ljca_bench *bench;
+	u64 start;
+	u8 ibuf[LJCA_MAX_FRAME_SIZE];
+};
+
+struct ljca_bench {
+	int size;
+	u8 obuf[LJCA_MAX_FRAME_SIZE];
+	struct ljca_bench_slot slots[LJCA_TX_BUFS];
+
+	/* protects everything below, callbacks run in atomic context */
+	spinlock_t lock;
+	wait_queue_head_t wq;
+	unsigned long free_slots;
+	int completed;
+	int errors;
+	int not_echoed;
+	int ok;
+	u64 *lat;
+};
+
+static void ljca_bench_done(void *context, int status, int ibuf_len)
+{
+	struct ljca_bench_slot *slot = context;
+	struct ljca_bench *b = slot->bench;
+	u64 lat = ktime_get_ns() - slot->start;
+	unsigned long flags;
+
+	spin_lock_irqsave(&b->lock, flags);
+	if (status) {
+		b->errors++;
+	} else {
+		if (ibuf_len != b->size || memcmp(slot->ibuf, b->obuf, b->size))
+			b->not_echoed++;
+		b->lat[b->ok++] = lat;
+	}
+	b->completed++;
+	__set_bit(slot - b->slots, &b->free_slots);
+	/* woken under the lock, the runner frees b once it took it */
+	wake_up(&b->wq);
+	spin_unlock_irqrestore(&b->lock, flags);
+}
 
-	ljca->state = LJCA_RESET_SYNCED;
+static bool ljca_bench_slot_get(struct ljca_bench *b, int *i)
+{
+	bool found = false;
 
-	/* workaround for FW limitation, ignore return value of enum result */
-	ljca_mng_enum_gpio(stub);
-	ljca->state = LJCA_ENUM_GPIO_COMPLETE;
+	spin_lock_irq(&b->lock);
+	if (b->free_slots) {
+		*i = __ffs(b->free_slots);
+		__clear_bit(*i, &b->free_slots);
+		found = true;
+	}
+	spin_unlock_irq(&b->lock);
 
-	ljca_mng_enum_i2c(stub);
-	ljca->state = LJCA_ENUM_I2C_COMPLETE;
+	return found;
+}
 
-	ljca_mng_enum_spi(stub);
-	ljca->state = LJCA_ENUM_SPI_COMPLETE;
+static int ljca_bench_cmp(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a;
+	u64 y = *(const u64 *)b;
 
-	return 0;
+	return x < y ? -1 : x > y;
 }
 
-static int ljca_mng_init(struct ljca_dev *ljca)
+static u64 ljca_bench_pct(struct ljca_bench *b, int permille)
 {
-	struct ljca_stub *stub;
-	struct ljca_mng_priv *priv;
+	return b->ok ? b->lat[min(b->ok - 1, (int)div_u64((u64)b->ok * permille,
+							   1000))] :
+		       0;
+}
+
+/*
+ * Loop messages through the bridge in echo mode, with up to depth of them
+ * in flight, over the same write and read path the children use. An echo
+ * comes back as the ACK of the command that was sent. Sending stops after
+ * count messages or LJCA_BENCH_MAX_MS, only a run that was not interrupted
+ * replaces the last result.
+ */
+static int ljca_bench_run(struct ljca_dev *ljca, int size, int depth,
+			  int count)
+{
+	struct ljca_stub *stub = ljca_stub_find(ljca, DIAG_STUB);
+	struct ljca_bench_result res = {};
+	struct ljca_bench_result *r = &res;
+	struct ljca_bench *b;
+	bool coredump;
+	u64 deadline;
+	u64 start;
+	int sent;
 	int ret;
+	int i;
 
-	stub = ljca_stub_alloc(ljca, sizeof(*priv));
 	if (IS_ERR(stub))
 		return PTR_ERR(stub);
 
-	priv = ljca_priv(stub);
-	if (!priv)
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (!b)
 		return -ENOMEM;
 
-	priv->reset_id = 0;
-	stub->type = MNG_STUB;
-	stub->intf = ljca->intf;
+	b->lat = vmalloc(array_size(count, sizeof(*b->lat)));
+	if (!b->lat) {
+		kfree(b);
+		return -ENOMEM;
+	}
 
-	ret = ljca_mng_link(ljca, stub);
+	b->size = size;
+	for (i = 0; i < size; i++)
+		b->obuf[i] = i;
+	for (i = 0; i < depth; i++) {
+		b->slots[i].bench = b;
+		__set_bit(i, &b->free_slots);
+	}
+	spin_lock_init(&b->lock);
+	init_waitqueue_head(&b->wq);
+
+	ret = ljca_autopm_get(ljca);
 	if (ret)
-		dev_err(&ljca->intf->dev,
-			"mng stub link done ret:%d state:%d\n", ret,
-			ljca->state);
+		goto out_free;
+
+	WRITE_ONCE(ljca->bench_running, true);
+	/* pairs with ljca_cmd_arm() and ljca_io_put() */
+	smp_mb();
+	start = ktime_get_ns();
+	deadline = start + LJCA_BENCH_MAX_MS * NSEC_PER_MSEC;
+	if (!wait_event_timeout(ljca->io_wq, !atomic_read(&ljca->io_pending),
+				msecs_to_jiffies(LJCA_BENCH_MAX_MS))) {
+		ret = -EBUSY;
+		goto out_put;
+	}
 
-	return ret;
-}
+	/* the DIAG pollers would read echoes, they restart after the run */
+	cancel_delayed_work_sync(&ljca->fw_log_work);
+	cancel_delayed_work_sync(&ljca->fw_stats_work);
+	coredump = cancel_work_sync(&ljca->coredump_work);
 
-static inline int ljca_diag_get_fw_log(struct ljca_stub *stub, void *buf)
-{
-	int ret;
-	int len;
+	ret = ljca_diag_set_echo_mode(stub, 1);
+	if (ret) {
+		dev_err(&ljca->intf->dev, "DIAG_SET_ECHO_MODE failed ret:%d\n",
+			ret);
+		goto out_resume;
+	}
 
-	if (!buf)
-		return -EINVAL;
+	start = ktime_get_ns();
+	for (sent = 0; sent < count && ktime_get_ns() < deadline; sent++) {
+		ret = wait_event_interruptible(b->wq,
+					       ljca_bench_slot_get(b, &i));
+		if (ret)
+			break;
 
-	ret = ljca_stub_write(stub, DIAG_GET_FW_LOG, NULL, 0, buf, &len, true,
-			      USB_WRITE_ACK_TIMEOUT);
-	if (ret)
-		return ret;
+		b->slots[i].start = ktime_get_ns();
+		ret = ljca_stub_write_async(stub, DIAG_GET_STATE, b->obuf, size,
+					    b->slots[i].ibuf,
+					    sizeof(b->slots[i].ibuf),
+					    ljca_bench_done, &b->slots[i]);
+		if (ret)
+			break;
+	}
 
-	return len;
+	/* every callback has to have left b before it goes */
+	wait_event(b->wq, READ_ONCE(b->completed) == sent);
+	spin_lock_irq(&b->lock);
+	spin_unlock_irq(&b->lock);
+
+	r->elapsed_ns = ktime_get_ns() - start;
+	ljca_diag_set_echo_mode(stub, 0);
+
+	sort(b->lat, b->ok, sizeof(*b->lat), ljca_bench_cmp, NULL);
+	r->size = size;
+	r->depth = depth;
+	r->count = sent;
+	r->errors = b->errors;
+	r->not_echoed = b->not_echoed;
+	r->p50_ns = ljca_bench_pct(b, 500);
+	r->p99_ns = ljca_bench_pct(b, 990);
+	r->p999_ns = ljca_bench_pct(b, 999);
+	if (!ret && sent)
+		ljca->bench_result = res;
+out_resume:
+	/* ljca_halt() waits for the run, a stopped bridge restarts nothing */
+	if (ljca->state != LJCA_STOPPED) {
+		if (ljca->fw_log_buf)
+			queue_delayed_work(system_freezable_wq,
+					   &ljca->fw_log_work, 0);
+		if (fw_stats_ms)
+			queue_delayed_work(system_freezable_wq,
+					   &ljca->fw_stats_work, 0);
+		if (coredump)
+			queue_work(system_freezable_wq, &ljca->coredump_work);
+	}
+out_put:
+	WRITE_ONCE(ljca->bench_running, false);
+	usb_autopm_put_interface(ljca->intf);
+out_free:
+	vfree(b->lat);
+	kfree(b);
+	return ret;
 }
 
-static inline int ljca_diag_get_coredump(struct ljca_stub *stub, void *buf)
+static int ljca_diag_init(struct ljca_dev *ljca)
 {
-	int ret;
-	int len;
-
-	if (!buf)
-		return -EINVAL;
+	struct ljca_stub *stub;
 
-	ret = ljca_stub_write(stub, DIAG_GET_FW_COREDUMP, NULL, 0, buf, &len,
-			      true, USB_WRITE_ACK_TIMEOUT);
-	if (ret)
-		return ret;
+	stub = ljca_stub_alloc(ljca, DIAG_STUB, 0);
+	if (IS_ERR(stub))
+		return PTR_ERR(stub);
 
-	return len;
+	return fw_log ? ljca_fw_log_init(ljca) : 0;
 }
 
-static inline int ljca_diag_set_trace_level(struct ljca_stub *stub, u8 level)
+static int ljca_tx_alloc(struct ljca_dev *ljca)
 {
-	return ljca_stub_write(stub, DIAG_SET_TRACE_LEVEL, &level,
-			       sizeof(level), NULL, NULL, true,
-			       USB_WRITE_ACK_TIMEOUT);
+	struct ljca_tx_buf *tx;
+	int i;
+
+	for (i = 0; i < LJCA_TX_BUFS; i++) {
+		tx = &ljca->tx_bufs[i];
+		tx->urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!tx->urb)
+			return -ENOMEM;
+
+		tx->buf = usb_alloc_coherent(ljca->udev, ljca->frame_size,
+					     GFP_KERNEL, &tx->dma);
+		if (!tx->buf)
+			return -ENOMEM;
+
+		usb_fill_bulk_urb(tx->urb, ljca->udev,
+				  usb_sndbulkpipe(ljca->udev, ljca->out_ep),
+				  tx->buf, ljca->frame_size, ljca_write_complete,
+				  tx);
+		tx->urb->transfer_dma = tx->dma;
+		tx->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		list_add_tail(&tx->list, &ljca->tx_free);
+	}
+
+	return 0;
 }
 
-static int ljca_diag_init(struct ljca_dev *ljca)
+static void ljca_tx_free(struct ljca_dev *ljca)
 {
-	struct ljca_stub *stub;
-
-	stub = ljca_stub_alloc(ljca, 0);
-	if (IS_ERR(stub))
-		return PTR_ERR(stub);
+	struct ljca_tx_buf *tx;
+	int i;
 
-	stub->type = DIAG_STUB;
-	stub->intf = ljca->intf;
-	return 0;
+	for (i = 0; i < LJCA_TX_BUFS; i++) {
+		tx = &ljca->tx_bufs[i];
+		del_timer_sync(&tx->tag.timer);
+		usb_free_coherent(ljca->udev, ljca->frame_size, tx->buf,
+				  tx->dma);
+		usb_free_urb(tx->urb);
+	}
 }
 
 static void ljca_delete(struct ljca_dev *ljca)
 {
-	mutex_destroy(&ljca->mutex);
-	usb_free_urb(ljca->in_urb);
+	ljca_tx_free(ljca);
+	ljca_rx_free(ljca);
+	free_percpu(ljca->stats);
+	kfifo_free(&ljca->fw_log);
+	kfree(ljca->fw_log_buf);
 	usb_put_intf(ljca->intf);
 	usb_put_dev(ljca->udev);
-	kfree(ljca->ibuf);
 	kfree(ljca->cells);
 	kfree(ljca);
 }
 
 static int ljca_init(struct ljca_dev *ljca)
 {
-	mutex_init(&ljca->mutex);
-	init_waitqueue_head(&ljca->ack_wq);
+	struct ljca_tx_buf *tx;
+	int i;
+
+	for (i = 0; i < LJCA_TX_BUFS; i++) {
+		tx = &ljca->tx_bufs[i];
+		tx->ljca = ljca;
+		INIT_LIST_HEAD(&tx->packed);
+		INIT_LIST_HEAD(&tx->pack_node);
+		INIT_LIST_HEAD(&tx->tag.list);
+		init_completion(&tx->tag.done);
+		timer_setup(&tx->tag.timer, ljca_cmd_timeout, 0);
+	}
+
+	ljca->ops = &ljca_usb_ops;
 	INIT_LIST_HEAD(&ljca->stubs_list);
+	INIT_LIST_HEAD(&ljca->tx_free);
+	spin_lock_init(&ljca->tx_lock);
+	init_waitqueue_head(&ljca->tx_wq);
+	init_usb_anchor(&ljca->rx_anchor);
+	INIT_WORK(&ljca->enum_work, ljca_enum_confirm_work);
+	INIT_DELAYED_WORK(&ljca->fw_log_work, ljca_fw_log_work);
+	INIT_WORK(&ljca->coredump_work, ljca_coredump_work);
+	INIT_DELAYED_WORK(&ljca->fw_stats_work, ljca_fw_stats_work);
+	mutex_init(&ljca->fw_stats_lock);
+	mutex_init(&ljca->bench_lock);
+	init_waitqueue_head(&ljca->io_wq);
+	INIT_DELAYED_WORK(&ljca->health_work, ljca_health_work);
+	spin_lock_init(&ljca->storm_lock);
+	spin_lock_init(&ljca->capture_lock);
+	mutex_init(&ljca->capture_mutex);
+	init_waitqueue_head(&ljca->capture_wq);
+	mutex_init(&ljca->fw_log_lock);
+	init_waitqueue_head(&ljca->fw_log_wq);
+	mutex_init(&ljca->pm_lock);
+	atomic64_set(&ljca->pm_last_busy, ktime_get_ns());
 
 	ljca->state = LJCA_INITED;
 
@@ -1039,7 +3385,83 @@ static int ljca_init(struct ljca_dev *ljca)
 
 static void ljca_stop(struct ljca_dev *ljca)
 {
-	usb_kill_urb(ljca->in_urb);
+	struct ljca_stub *stub;
+	int i;
+
+	usb_kill_anchored_urbs(&ljca->rx_anchor);
+	list_for_each_entry (stub, &ljca->stubs_list, list)
+		flush_work(&stub->event_work);
+
+	for (i = 0; i < LJCA_TX_BUFS; i++)
+		usb_kill_urb(ljca->tx_bufs[i].urb);
+}
+
+/* end the commands still waiting for an ACK that can no longer come */
+static void ljca_cancel_pending(struct ljca_dev *ljca)
+{
+	struct ljca_tx_buf *tx;
+	struct ljca_stub *stub;
+	struct ljca_cmd *tag;
+	unsigned long flags;
+
+	list_for_each_entry (stub, &ljca->stubs_list, list) {
+		spin_lock_irqsave(&stub->cmd_lock, flags);
+		while ((tag = list_first_entry_or_null(&stub->pending,
+						       struct ljca_cmd, list))) {
+			tx = container_of(tag, struct ljca_tx_buf, tag);
+			/* ljca_sync_timers() takes the timer's reference */
+			if (tag->zombie) {
+				ljca_cmd_bury(tag);
+				spin_unlock_irqrestore(&stub->cmd_lock, flags);
+				ljca_tx_buf_unref(tx);
+				spin_lock_irqsave(&stub->cmd_lock, flags);
+				continue;
+			}
+
+			ljca_cmd_claim(tag);
+			spin_unlock_irqrestore(&stub->cmd_lock, flags);
+			ljca_cmd_complete(tx, -ENODEV);
+			spin_lock_irqsave(&stub->cmd_lock, flags);
+		}
+		spin_unlock_irqrestore(&stub->cmd_lock, flags);
+	}
+}
+
+/* wait out the command timers still running, they may queue work */
+static void ljca_sync_timers(struct ljca_dev *ljca)
+{
+	struct ljca_tx_buf *tx;
+	int i;
+
+	for (i = 0; i < LJCA_TX_BUFS; i++) {
+		tx = &ljca->tx_bufs[i];
+		if (del_timer_sync(&tx->tag.timer))
+			ljca_tx_buf_unref(tx);
+	}
+}
+
+/*
+ * Quiesce the bridge for good: once no command can be sent, answered or
+ * time out, nothing is left to queue the background works again.
+ */
+static void ljca_halt(struct ljca_dev *ljca)
+{
+	ljca_stop(ljca);
+	ljca->state = LJCA_STOPPED;
+	/* let blocked log readers see the end before debugfs goes away */
+	wake_up_interruptible(&ljca->fw_log_wq);
+	wake_up_interruptible(&ljca->capture_wq);
+	ljca_cancel_pending(ljca);
+	ljca_sync_timers(ljca);
+	/* a benchmark requeues the pollers it paused, let it see the state */
+	mutex_lock(&ljca->bench_lock);
+	mutex_unlock(&ljca->bench_lock);
+
+	cancel_work_sync(&ljca->enum_work);
+	cancel_delayed_work_sync(&ljca->fw_log_work);
+	cancel_work_sync(&ljca->coredump_work);
+	cancel_delayed_work_sync(&ljca->fw_stats_work);
+	cancel_delayed_work_sync(&ljca->health_work);
 }
 
 static ssize_t cmd_store(struct device *dev, struct device_attribute *attr,
@@ -1056,6 +3478,8 @@ static ssize_t cmd_store(struct device *dev, struct device_attribute *attr,
 		ljca_mng_reset(mng_stub);
 	else if (sysfs_streq(buf, "debug"))
 		ljca_diag_set_trace_level(diag_stub, 3);
+	else if (sysfs_streq(buf, "coredump"))
+		ljca_coredump_request(ljca, true);
 
 	return count;
 }
@@ -1063,7 +3487,7 @@ static ssize_t cmd_store(struct device *dev, struct device_attribute *attr,
 static ssize_t cmd_show(struct device *dev, struct device_attribute *attr,
 			char *buf)
 {
-	return sysfs_emit(buf, "%s\n", "supported cmd: [dfu, reset, debug]");
+	return sysfs_emit(buf, "%s\n", "supported cmd: [dfu, reset, debug, coredump]");
 }
 static DEVICE_ATTR_RW(cmd);
 
@@ -1109,6 +3533,360 @@ static struct attribute *ljca_attrs[] = {
 };
 ATTRIBUTE_GROUPS(ljca);
 
+static void ljca_fw_stats_show(struct seq_file *s, struct ljca_dev *ljca)
+{
+	u64 span_ms;
+	int i;
+
+	/* a read is a sample too, within the rate limit */
+	ljca_fw_stats_sample(ljca);
+
+	mutex_lock(&ljca->fw_stats_lock);
+	if (!ljca->fw_stats_ns) {
+		seq_puts(s, "fw: no statistics\n");
+		goto out;
+	}
+
+	seq_printf(s, "fw: sampled %llu ms ago\n",
+		   div_u64(ktime_get_ns() - ljca->fw_stats_ns, NSEC_PER_MSEC));
+	if (ljca->fw_state_len)
+		seq_printf(s, "fw state: %*phN\n", ljca->fw_state_len,
+			   ljca->fw_state);
+
+	span_ms = ljca->fw_stats_prev_ns ?
+			  div_u64(ljca->fw_stats_ns - ljca->fw_stats_prev_ns,
+				  NSEC_PER_MSEC) :
+			  0;
+	for (i = 0; i < ljca->fw_stats_num; i++) {
+		seq_printf(s, "fw stat[%d]: %u", i, ljca->fw_stats[i]);
+		if (span_ms)
+			seq_printf(s, " delta: %u in %llu ms",
+				   ljca->fw_stats[i] - ljca->fw_stats_prev[i],
+				   span_ms);
+		seq_puts(s, "\n");
+	}
+out:
+	mutex_unlock(&ljca->fw_stats_lock);
+}
+
+static void ljca_seq_hist(struct seq_file *s, const char *name,
+			  const u64 *hist)
+{
+	int i;
+
+	seq_puts(s, name);
+	for (i = 0; i < LJCA_LAT_BUCKETS; i++) {
+		if (hist[i])
+			seq_printf(s, " <%lu:%llu", BIT(i), hist[i]);
+	}
+	seq_puts(s, "\n");
+}
+
+static int stats_show(struct seq_file *s, void *unused)
+{
+	struct ljca_dev *ljca = s->private;
+	u64 ack_delay[LJCA_LAT_BUCKETS] = {};
+	u64 event_delay[LJCA_LAT_BUCKETS] = {};
+	struct ljca_cmd_stats sum;
+	struct ljca_stub *stub;
+	u64 invalid = 0;
+	int cpu;
+	int cmd;
+	int i;
+
+	for_each_possible_cpu (cpu) {
+		struct ljca_dev_stats *d = per_cpu_ptr(ljca->stats, cpu);
+
+		invalid += d->invalid;
+		for (i = 0; i < LJCA_LAT_BUCKETS; i++) {
+			ack_delay[i] += d->ack_delay[i];
+			event_delay[i] += d->event_delay[i];
+		}
+	}
+
+	seq_printf(s, "rx_all_busy: %d events dropped: %d invalid: %llu\n",
+		   atomic_read(&ljca->rx_all_busy),
+		   atomic_read(&ljca->rx_dropped), invalid);
+	ljca_seq_hist(s, "ack delay(us):", ack_delay);
+	ljca_seq_hist(s, "event delay(us):", event_delay);
+	seq_printf(s, "link: %s timeouts in a row: %d\n",
+		   READ_ONCE(ljca->degraded) ? "degraded" : "ok",
+		   atomic_read(&ljca->timeouts_in_row));
+	if (ljca->fw_log_buf)
+		seq_printf(s, "fw_log bytes: %llu dropped: %llu interval: %u ms\n",
+			   ljca->fw_log_bytes, ljca->fw_log_dropped,
+			   ljca->fw_log_interval);
+
+	list_for_each_entry (stub, &ljca->stubs_list, list) {
+		for (cmd = 0; cmd < LJCA_MAX_CMD; cmd++) {
+			memset(&sum, 0, sizeof(sum));
+			for_each_possible_cpu (cpu) {
+				struct ljca_cmd_stats *c =
+					&per_cpu_ptr(stub->stats, cpu)->cmds[cmd];
+
+				sum.sent += c->sent;
+				sum.acked += c->acked;
+				sum.timeouts += c->timeouts;
+				sum.mismatches += c->mismatches;
+				sum.late += c->late;
+				sum.bytes_out += c->bytes_out;
+				sum.bytes_in += c->bytes_in;
+				for (i = 0; i < LJCA_LAT_BUCKETS; i++)
+					sum.latency[i] += c->latency[i];
+			}
+
+			if (!sum.sent && !sum.mismatches)
+				continue;
+
+			seq_printf(s,
+				   "stub:%d cmd:%d sent:%llu acked:%llu timeouts:%llu late:%llu mismatches:%llu bytes_out:%llu bytes_in:%llu\n",
+				   stub->type, cmd, sum.sent, sum.acked,
+				   sum.timeouts, sum.late, sum.mismatches,
+				   sum.bytes_out, sum.bytes_in);
+			seq_printf(s, "\tsrtt:%u us rttvar:%u us rto:%d ms\n",
+				   stub->rto[cmd].srtt, stub->rto[cmd].rttvar,
+				   ljca_rto(stub, cmd, USB_WRITE_ACK_TIMEOUT));
+			ljca_seq_hist(s, "\tack latency(us):", sum.latency);
+		}
+	}
+
+	ljca_fw_stats_show(s, ljca);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+static int pm_show(struct seq_file *s, void *unused)
+{
+	struct ljca_dev *ljca = s->private;
+
+	mutex_lock(&ljca->pm_lock);
+	seq_printf(s, "resumes: %d\n", atomic_read(&ljca->pm_resumes));
+	seq_printf(s, "stalled commands: %llu total: %llu us max: %llu us\n",
+		   ljca->pm_stalls, div_u64(ljca->pm_stall_ns, NSEC_PER_USEC),
+		   div_u64(ljca->pm_stall_max_ns, NSEC_PER_USEC));
+	seq_printf(s, "autosuspend delay: %d ms base: %d ms\n",
+		   READ_ONCE(ljca->udev->dev.power.autosuspend_delay),
+		   ljca->pm_base_delay);
+	mutex_unlock(&ljca->pm_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(pm);
+
+static int ljca_stream_open(struct inode *inode, struct file *file)
+{
+	file->private_data = inode->i_private;
+	return stream_open(inode, file);
+}
+
+static ssize_t fw_log_read(struct file *file, char __user *ubuf, size_t count,
+			   loff_t *ppos)
+{
+	struct ljca_dev *ljca = file->private_data;
+	unsigned int copied;
+	int ret;
+
+	if (kfifo_is_empty(&ljca->fw_log)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(ljca->fw_log_wq,
+					       !kfifo_is_empty(&ljca->fw_log) ||
+						       ljca->state == LJCA_STOPPED);
+		if (ret)
+			return ret;
+	}
+
+	mutex_lock(&ljca->fw_log_lock);
+	ret = kfifo_to_user(&ljca->fw_log, ubuf, count, &copied);
+	mutex_unlock(&ljca->fw_log_lock);
+
+	return ret ? ret : copied;
+}
+
+static __poll_t fw_log_poll(struct file *file, poll_table *wait)
+{
+	struct ljca_dev *ljca = file->private_data;
+
+	poll_wait(file, &ljca->fw_log_wq, wait);
+	if (!kfifo_is_empty(&ljca->fw_log))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return ljca->state == LJCA_STOPPED ? EPOLLHUP : 0;
+}
+
+static const struct file_operations fw_log_fops = {
+	.owner = THIS_MODULE,
+	.open = ljca_stream_open,
+	.read = fw_log_read,
+	.poll = fw_log_poll,
+};
+
+static ssize_t capture_read(struct file *file, char __user *ubuf,
+			    size_t count, loff_t *ppos)
+{
+	struct ljca_dev *ljca = file->private_data;
+	unsigned int copied = 0;
+	int ret;
+
+	if (kfifo_is_empty(&ljca->capture)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(ljca->capture_wq,
+					       !kfifo_is_empty(&ljca->capture) ||
+						       !ljca->capture_on ||
+						       ljca->state == LJCA_STOPPED);
+		if (ret)
+			return ret;
+	}
+
+	mutex_lock(&ljca->capture_mutex);
+	ret = ljca->capture_on ?
+		      kfifo_to_user(&ljca->capture, ubuf, count, &copied) :
+		      0;
+	mutex_unlock(&ljca->capture_mutex);
+
+	return ret ? ret : copied;
+}
+
+static __poll_t capture_poll(struct file *file, poll_table *wait)
+{
+	struct ljca_dev *ljca = file->private_data;
+
+	poll_wait(file, &ljca->capture_wq, wait);
+	if (!kfifo_is_empty(&ljca->capture))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return ljca->capture_on && ljca->state != LJCA_STOPPED ? 0 : EPOLLHUP;
+}
+
+static const struct file_operations capture_fops = {
+	.owner = THIS_MODULE,
+	.open = ljca_stream_open,
+	.read = capture_read,
+	.poll = capture_poll,
+};
+
+static ssize_t capture_enable_read(struct file *file, char __user *ubuf,
+				   size_t count, loff_t *ppos)
+{
+	struct ljca_dev *ljca = file->private_data;
+	char buf[48];
+	int len;
+
+	len = scnprintf(buf, sizeof(buf), "%d dropped:%llu\n",
+			ljca->capture_on, ljca->capture_dropped);
+	return simple_read_from_buffer(ubuf, count, ppos, buf, len);
+}
+
+static ssize_t capture_enable_write(struct file *file, const char __user *ubuf,
+				    size_t count, loff_t *ppos)
+{
+	struct ljca_dev *ljca = file->private_data;
+	bool on;
+	int ret;
+
+	ret = kstrtobool_from_user(ubuf, count, &on);
+	if (ret)
+		return ret;
+
+	ret = ljca_capture_set(ljca, on);
+	return ret ? ret : count;
+}
+
+static const struct file_operations capture_enable_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = capture_enable_read,
+	.write = capture_enable_write,
+};
+
+static int bench_show(struct seq_file *s, void *unused)
+{
+	struct ljca_dev *ljca = s->private;
+	struct ljca_bench_result *r = &ljca->bench_result;
+
+	mutex_lock(&ljca->bench_lock);
+	if (!r->count) {
+		seq_puts(s, "write \"<size> <depth> <count>\" to run\n");
+		goto out;
+	}
+
+	seq_printf(s, "size:%d depth:%d count:%d errors:%d not_echoed:%d\n",
+		   r->size, r->depth, r->count, r->errors, r->not_echoed);
+	seq_printf(s, "msgs/s:%llu\n",
+		   r->elapsed_ns ? div64_u64((u64)r->count * NSEC_PER_SEC,
+					     r->elapsed_ns) :
+				   0);
+	seq_printf(s, "rtt(us) p50:%llu p99:%llu p999:%llu\n",
+		   div_u64(r->p50_ns, NSEC_PER_USEC),
+		   div_u64(r->p99_ns, NSEC_PER_USEC),
+		   div_u64(r->p999_ns, NSEC_PER_USEC));
+out:
+	mutex_unlock(&ljca->bench_lock);
+	return 0;
+}
+
+static int bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bench_show, inode->i_private);
+}
+
+static ssize_t bench_write(struct file *file, const char __user *ubuf,
+			   size_t count, loff_t *ppos)
+{
+	struct ljca_dev *ljca = file_inode(file)->i_private;
+	int size, depth, num;
+	char *buf;
+	int ret;
+
+	buf = memdup_user_nul(ubuf, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	ret = sscanf(buf, "%d %d %d", &size, &depth, &num);
+	kfree(buf);
+	if (ret != 3 || size < 0 || size > ljca->max_payload || depth < 1 ||
+	    depth > LJCA_TX_BUFS || num < 1 || num > LJCA_BENCH_MAX_COUNT)
+		return -EINVAL;
+
+	mutex_lock(&ljca->bench_lock);
+	ret = ljca_bench_run(ljca, size, depth, num);
+	mutex_unlock(&ljca->bench_lock);
+
+	return ret ? ret : count;
+}
+
+static const struct file_operations bench_fops = {
+	.owner = THIS_MODULE,
+	.open = bench_open,
+	.read = seq_read,
+	.write = bench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void ljca_debugfs_init(struct ljca_dev *ljca)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "ljca-%s", dev_name(&ljca->intf->dev));
+	ljca->debugfs_dir = debugfs_create_dir(name, usb_debug_root);
+	debugfs_create_file("stats", 0444, ljca->debugfs_dir, ljca,
+			    &stats_fops);
+	debugfs_create_file("pm", 0444, ljca->debugfs_dir, ljca, &pm_fops);
+	debugfs_create_file("capture", 0400, ljca->debugfs_dir, ljca,
+			    &capture_fops);
+	debugfs_create_file("capture_enable", 0600, ljca->debugfs_dir, ljca,
+			    &capture_enable_fops);
+	debugfs_create_file("bench", 0600, ljca->debugfs_dir, ljca,
+			    &bench_fops);
+	if (ljca->fw_log_buf)
+		debugfs_create_file("fw_log", 0400, ljca->debugfs_dir, ljca,
+				    &fw_log_fops);
+}
+
 static int ljca_probe(struct usb_interface *intf,
 		      const struct usb_device_id *id)
 {
@@ -1116,19 +3894,28 @@ static int ljca_probe(struct usb_interface *intf,
 	struct usb_endpoint_descriptor *bulk_in, *bulk_out;
 	int ret;
 
-	cur_dev = &intf->dev;
-	ret = precheck_acpi_hid(intf);
-	if (ret)
-		return ret;
-
 	/* allocate memory for our device state and initialize it */
 	ljca = kzalloc(sizeof(*ljca), GFP_KERNEL);
 	if (!ljca)
 		return -ENOMEM;
 
+	ljca->stats = alloc_percpu(struct ljca_dev_stats);
+	if (!ljca->stats) {
+		kfree(ljca);
+		return -ENOMEM;
+	}
+
 	ljca_init(ljca);
 	ljca->udev = usb_get_dev(interface_to_usbdev(intf));
 	ljca->intf = usb_get_intf(intf);
+	ljca->pm_base_delay = ljca->udev->dev.power.autosuspend_delay;
+	ljca->pm_delay = ljca->pm_base_delay;
+
+	ret = precheck_acpi_hid(ljca, intf);
+	if (ret) {
+		ljca_delete(ljca);
+		return ret;
+	}
 
 	/* set up the endpoint information use only the first bulk-in and bulk-out endpoints */
 	ret = usb_find_common_endpoints(intf->cur_altsetting, &bulk_in,
@@ -1141,21 +3928,25 @@ static int ljca_probe(struct usb_interface *intf,
 
 	ljca->ibuf_len = usb_endpoint_maxp(bulk_in);
 	ljca->in_ep = bulk_in->bEndpointAddress;
-	ljca->ibuf = kzalloc(ljca->ibuf_len, GFP_KERNEL);
-	if (!ljca->ibuf) {
-		ret = -ENOMEM;
+	ret = ljca_rx_alloc(ljca);
+	if (ret)
 		goto error;
-	}
 
-	ljca->in_urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!ljca->in_urb) {
-		ret = -ENOMEM;
+	ljca->out_ep = bulk_out->bEndpointAddress;
+	ljca->frame_size = MAX_PACKET_SIZE;
+	/* a reply has to fit one read as well */
+	if (large_frames)
+		ljca->frame_size = min3(usb_endpoint_maxp(bulk_out),
+					usb_endpoint_maxp(bulk_in),
+					(int)LJCA_MAX_FRAME_SIZE);
+	ljca->max_payload = ljca->frame_size - sizeof(struct ljca_msg);
+	ret = ljca_tx_alloc(ljca);
+	if (ret)
 		goto error;
-	}
 
-	ljca->out_ep = bulk_out->bEndpointAddress;
-	dev_dbg(&intf->dev, "bulk_in size:%zu addr:%d bulk_out addr:%d\n",
-		ljca->ibuf_len, ljca->in_ep, ljca->out_ep);
+	dev_dbg(&intf->dev,
+		"bulk_in size:%zu addr:%d bulk_out addr:%d frame size:%d\n",
+		ljca->ibuf_len, ljca->in_ep, ljca->out_ep, ljca->frame_size);
 
 	/* save our data pointer in this intf device */
 	usb_set_intfdata(intf, ljca);
@@ -1177,8 +3968,10 @@ static int ljca_probe(struct usb_interface *intf,
 		goto error_stop;
 	}
 
-	ret = mfd_add_hotplug_devices(sub_dev_parent, ljca->cells,
-				      ljca->cell_count);
+	/* before the children, they add their files below it */
+	ljca_debugfs_init(ljca);
+
+	ret = ljca_add_cells(ljca);
 	if (ret) {
 		dev_err(&intf->dev, "failed to add mfd devices to core %d\n",
 			ljca->cell_count);
@@ -1186,10 +3979,20 @@ static int ljca_probe(struct usb_interface *intf,
 	}
 
 	ljca->state = LJCA_STARTED;
+	if (ljca->enum_cached)
+		queue_work(system_freezable_wq, &ljca->enum_work);
+	if (ljca->fw_log_buf)
+		queue_delayed_work(system_freezable_wq, &ljca->fw_log_work, 0);
+	if (fw_stats_ms)
+		queue_delayed_work(system_freezable_wq, &ljca->fw_stats_work, 0);
+
 	dev_info(&intf->dev, "LJCA USB device init success\n");
 	return 0;
 error_stop:
-	ljca_stop(ljca);
+	/* also cancels a dump the timeouts while linking asked for */
+	ljca_halt(ljca);
+	debugfs_remove_recursive(ljca->debugfs_dir);
+	ljca_capture_set(ljca, false);
 error:
 	dev_err(&intf->dev, "LJCA USB device init failed\n");
 	/* this frees allocated memory */
@@ -1204,10 +4007,16 @@ static void ljca_disconnect(struct usb_interface *intf)
 
 	ljca = usb_get_intfdata(intf);
 
-	ljca_stop(ljca);
-	ljca->state = LJCA_STOPPED;
-	mfd_remove_devices(sub_dev_parent);
+	ljca_halt(ljca);
+	ljca_remove_cells(ljca);
+	debugfs_remove_recursive(ljca->debugfs_dir);
+	ljca_capture_set(ljca, false);
 	ljca_stub_cleanup(ljca);
+	/* hand back the delay found at probe unless it was changed since */
+	if (ljca->pm_delay != ljca->pm_base_delay &&
+	    ljca->udev->dev.power.autosuspend_delay == ljca->pm_delay)
+		pm_runtime_set_autosuspend_delay(&ljca->udev->dev,
+						 ljca->pm_base_delay);
 	usb_set_intfdata(intf, NULL);
 	ljca_delete(ljca);
 	dev_info(&intf->dev, "LJCA disconnected\n");
@@ -1229,6 +4038,7 @@ static int ljca_resume(struct usb_interface *intf)
 	struct ljca_dev *ljca = usb_get_intfdata(intf);
 
 	ljca->state = LJCA_STARTED;
+	atomic_inc(&ljca->pm_resumes);
 	dev_dbg(&intf->dev, "LJCA resume\n");
 	return ljca_start(ljca);
 }
@@ -1250,7 +4060,22 @@ static struct usb_driver ljca_driver = {
 	.supports_autosuspend = 1,
 };
 
-module_usb_driver(ljca_driver);
+static int __init ljca_driver_init(void)
+{
+	return usb_register(&ljca_driver);
+}
+module_init(ljca_driver_init);
+
+static void __exit ljca_driver_exit(void)
+{
+	usb_deregister(&ljca_driver);
+	ljca_enum_cache_free();
+}
+module_exit(ljca_driver_exit);
+
+#if IS_ENABLED(CONFIG_LJCA_KUNIT_TEST)
+#include "ljca-test.c"
+#endif
 
 MODULE_AUTHOR("Ye Xiang <xiang.ye@intel.com>");
 MODULE_AUTHOR("Zhang Lixu <lixu.zhang@intel.com>");
@@ -6,10 +6,13 @@
  */
 
 #include <linux/acpi.h>
+#include <linux/delay.h>
 #include <linux/mfd/ljca.h>
 #include <linux/module.h>
 #include <linux/platform_device.h>
+#include <linux/slab.h>
 #include <linux/spi/spi.h>
+#include <linux/version.h>
 
 /* SPI commands */
 enum ljca_spi_cmd {
@@ -40,9 +43,10 @@ enum {
 	LJCA_SPI_CLOCK_SECOND_PHASE,
 };
 
-#define LJCA_SPI_BUF_SIZE 60
-#define LJCA_SPI_MAX_XFER_SIZE                                                 \
-	(LJCA_SPI_BUF_SIZE - sizeof(struct spi_xfer_packet))
+/* the packet's s8 len bounds a fragment whatever the bridge's framing */
+#define LJCA_SPI_MAX_XFER_SIZE S8_MAX
+/* holds any ACK, their u8 len is the limit */
+#define LJCA_SPI_BUF_SIZE 256
 union spi_clock_mode {
 	struct {
 		u8 polarity : 1;
@@ -71,27 +75,76 @@ struct spi_xfer_packet {
 	u8 data[];
 } __packed;
 
+/* the fragment id is 6 bits wide */
+#define LJCA_SPI_MAX_FRAGMENTS 64
+/* each fragment holds a transmit buffer, leave some to GPIO and I2C */
+#define LJCA_SPI_MAX_WINDOW (LJCA_TX_BUFS - 2)
+
+static unsigned int stream_window = 4;
+module_param(stream_window, uint, 0644);
+MODULE_PARM_DESC(stream_window,
+		 "Fragments kept in flight per transfer (1 = wait for each ACK, max 6)");
+
+struct ljca_spi_dev;
+
+/* one fragment in flight, busy until its ACK was handled */
+struct ljca_spi_frag {
+	struct ljca_spi_dev *ljca_spi;
+	bool busy;
+	u8 *r_data;
+	int len;
+	u8 ibuf[LJCA_SPI_BUF_SIZE];
+};
+
 struct ljca_spi_dev {
 	struct platform_device *pdev;
 	struct ljca_spi_info *ctr_info;
 	struct spi_master *master;
 	u8 speed;
 	u8 mode;
+	/* data bytes of one fragment */
+	int frag_size;
 
-	u8 obuf[LJCA_SPI_BUF_SIZE];
-	u8 ibuf[LJCA_SPI_BUF_SIZE];
+	struct ljca_spi_frag frags[LJCA_SPI_MAX_WINDOW];
+	wait_queue_head_t frag_wq;
+	/* first error of the stream in progress */
+	int frag_status;
 };
 
-static int ljca_spi_read_write(struct ljca_spi_dev *ljca_spi, const u8 *w_data,
-			       u8 *r_data, int len, int id, int complete,
-			       int cmd)
+static void ljca_spi_frag_done(void *context, int status, int ibuf_len)
 {
-	struct spi_xfer_packet *w_packet =
-		(struct spi_xfer_packet *)ljca_spi->obuf;
-	struct spi_xfer_packet *r_packet =
-		(struct spi_xfer_packet *)ljca_spi->ibuf;
+	struct ljca_spi_frag *frag = context;
+	struct ljca_spi_dev *ljca_spi = frag->ljca_spi;
+	struct spi_xfer_packet *r_packet = (struct spi_xfer_packet *)frag->ibuf;
+
+	if (!status && (ibuf_len < sizeof(*r_packet) || r_packet->len <= 0)) {
+		dev_err(&ljca_spi->pdev->dev, "receive patcket error len %d\n",
+			ibuf_len < sizeof(*r_packet) ? 0 : r_packet->len);
+		status = -EIO;
+	}
+
+	if (status)
+		cmpxchg(&ljca_spi->frag_status, 0, status);
+	else if (frag->r_data)
+		memcpy(frag->r_data, r_packet->data,
+		       min_t(int, r_packet->len, frag->len));
+
+	/* pairs with the wait_event() in ljca_spi_transfer() */
+	smp_store_release(&frag->busy, false);
+	wake_up(&ljca_spi->frag_wq);
+}
+
+static int ljca_spi_frag_submit(struct ljca_spi_dev *ljca_spi,
+				struct ljca_spi_frag *frag, const u8 *w_data,
+				u8 *r_data, int len, int id, int complete,
+				int cmd)
+{
+	struct spi_xfer_packet *w_packet;
 	int ret;
-	int ibuf_len;
+
+	w_packet = ljca_get_tx_buf(ljca_spi->pdev, NULL);
+	if (!w_packet)
+		return -ENODEV;
 
 	w_packet->indicator.index = ljca_spi->ctr_info->id;
 	w_packet->indicator.id = id;
@@ -105,22 +158,16 @@ static int ljca_spi_read_write(struct ljca_spi_dev *ljca_spi, const u8 *w_data,
 		memcpy(w_packet->data, w_data, len);
 	}
 
-	ret = ljca_transfer(ljca_spi->pdev, cmd, w_packet,
-			    sizeof(*w_packet) + w_packet->len, r_packet,
-			    &ibuf_len);
+	frag->r_data = r_data;
+	frag->len = len;
+	frag->busy = true;
+	ret = ljca_transfer_tx_buf_async(ljca_spi->pdev, cmd, w_packet,
+					 sizeof(*w_packet) + w_packet->len,
+					 frag->ibuf, ljca_spi_frag_done, frag);
 	if (ret)
-		return ret;
+		frag->busy = false;
 
-	if (ibuf_len < sizeof(*r_packet) || r_packet->len <= 0) {
-		dev_err(&ljca_spi->pdev->dev, "receive patcket error len %d\n",
-			r_packet->len);
-		return -EIO;
-	}
-
-	if (r_data)
-		memcpy(r_data, r_packet->data, r_packet->len);
-
-	return 0;
+	return ret;
 }
 
 static int ljca_spi_init(struct ljca_spi_dev *ljca_spi, int div, int mode)
@@ -162,90 +209,273 @@ static int ljca_spi_deinit(struct ljca_spi_dev *ljca_spi)
 			     sizeof(w_packet), NULL, NULL);
 }
 
+static bool ljca_spi_frags_idle(struct ljca_spi_dev *ljca_spi, int window)
+{
+	int i;
+
+	for (i = 0; i < window; i++) {
+		if (smp_load_acquire(&ljca_spi->frags[i].busy))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Stream the fragments of one transfer, keeping up to stream_window of them
+ * in flight. The firmware reassembles them by indicator.id and cmpl, their
+ * ACKs come back in order and carry the read data of each fragment.
+ */
 static int ljca_spi_transfer(struct ljca_spi_dev *ljca_spi, const u8 *tx_data,
-			     u8 *rx_data, u16 len)
+			     u8 *rx_data, u32 len)
 {
-	int ret;
+	int window = clamp_t(int, READ_ONCE(stream_window), 1,
+			     LJCA_SPI_MAX_WINDOW);
+	struct ljca_spi_frag *frag;
 	int remaining = len;
 	int offset = 0;
 	int cur_len;
 	int complete = 0;
+	int ret = 0;
+	int cmd;
 	int i;
 
+	if (!len)
+		return 0;
+
+	if (tx_data && rx_data)
+		cmd = LJCA_SPI_WRITEREAD;
+	else if (tx_data)
+		cmd = LJCA_SPI_WRITE;
+	else if (rx_data)
+		cmd = LJCA_SPI_READ;
+	else
+		return -EINVAL;
+
+	ljca_spi->frag_status = 0;
 	for (i = 0; remaining > 0;
 	     offset += cur_len, remaining -= cur_len, i++) {
 		dev_dbg(&ljca_spi->pdev->dev,
-			"fragment %d offset %d remaining %d ret %d\n", i,
-			offset, remaining, ret);
+			"fragment %d offset %d remaining %d\n", i, offset,
+			remaining);
 
-		if (remaining > LJCA_SPI_MAX_XFER_SIZE) {
-			cur_len = LJCA_SPI_MAX_XFER_SIZE;
+		if (remaining > ljca_spi->frag_size) {
+			cur_len = ljca_spi->frag_size;
 		} else {
 			cur_len = remaining;
 			complete = 1;
 		}
 
-		if (tx_data && rx_data)
-			ret = ljca_spi_read_write(ljca_spi, tx_data + offset,
-						  rx_data + offset, cur_len, i,
-						  complete, LJCA_SPI_WRITEREAD);
-		else if (tx_data)
-			ret = ljca_spi_read_write(ljca_spi, tx_data + offset,
-						  NULL, cur_len, i, complete,
-						  LJCA_SPI_WRITE);
-		else if (rx_data)
-			ret = ljca_spi_read_write(ljca_spi, NULL,
-						  rx_data + offset, cur_len, i,
-						  complete, LJCA_SPI_READ);
-		else
-			return -EINVAL;
+		frag = &ljca_spi->frags[i % window];
+		wait_event(ljca_spi->frag_wq, !smp_load_acquire(&frag->busy));
+		if (READ_ONCE(ljca_spi->frag_status))
+			break;
 
+		ret = ljca_spi_frag_submit(ljca_spi, frag,
+					   tx_data ? tx_data + offset : NULL,
+					   rx_data ? rx_data + offset : NULL,
+					   cur_len, i, complete, cmd);
 		if (ret)
-			return ret;
+			break;
 	}
 
-	return 0;
+	wait_event(ljca_spi->frag_wq, ljca_spi_frags_idle(ljca_spi, window));
+
+	return ret ? ret : READ_ONCE(ljca_spi->frag_status);
 }
 
-static int ljca_spi_prepare_message(struct spi_master *master,
-				    struct spi_message *message)
+/* beyond this the 6 bit fragment ids wrap within one transfer */
+static u32 ljca_spi_max_stream(struct ljca_spi_dev *ljca_spi)
 {
-	return 0;
+	return LJCA_SPI_MAX_FRAGMENTS * ljca_spi->frag_size;
 }
 
-static int ljca_spi_transfer_one(struct spi_master *master,
-				 struct spi_device *spi,
-				 struct spi_transfer *xfer)
+static bool ljca_spi_xfer_delayed(struct spi_transfer *xfer)
 {
-	struct ljca_spi_dev *ljca_spi = spi_master_get_devdata(master);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+	return xfer->delay.value;
+#else
+	return xfer->delay_usecs;
+#endif
+}
+
+static void ljca_spi_xfer_delay(struct spi_transfer *xfer)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+	spi_transfer_delay_exec(xfer);
+#else
+	if (xfer->delay_usecs)
+		udelay(xfer->delay_usecs);
+#endif
+}
+
+/* whether next can continue the fragment stream that prev is part of */
+static bool ljca_spi_can_merge(struct ljca_spi_dev *ljca_spi,
+			       struct spi_transfer *prev,
+			       struct spi_transfer *next, u32 len)
+{
+	return next->speed_hz == prev->speed_hz && !prev->cs_change &&
+	       !ljca_spi_xfer_delayed(prev) &&
+	       len + next->len <= ljca_spi_max_stream(ljca_spi);
+}
+
+/*
+ * Run transfers first to last as one fragment stream. A single transfer
+ * goes out as is. Several go through bounce buffers as WRITEREAD, unless
+ * all of them only write or only read, with zeros clocked out for reads.
+ */
+static int ljca_spi_run(struct ljca_spi_dev *ljca_spi, struct spi_message *msg,
+			struct spi_transfer *first, struct spi_transfer *last,
+			u32 len)
+{
+	struct spi_master *master = ljca_spi->master;
+	struct spi_transfer *xfer;
+	bool has_tx = false;
+	bool has_rx = false;
+	u8 *tx = NULL;
+	u8 *rx = NULL;
+	u32 offset;
 	int ret;
 	int div;
 
-	div = DIV_ROUND_UP(master->max_speed_hz, xfer->speed_hz) / 2 - 1;
+	div = DIV_ROUND_UP(master->max_speed_hz, first->speed_hz) / 2 - 1;
 	if (div > LJCA_SPI_BUS_SPEED_MIN)
 		div = LJCA_SPI_BUS_SPEED_MIN;
 
-	ret = ljca_spi_init(ljca_spi, div, spi->mode);
+	ret = ljca_spi_init(ljca_spi, div, msg->spi->mode);
 	if (ret < 0) {
 		dev_err(&ljca_spi->pdev->dev,
 			"cannot initialize transfer ret %d\n", ret);
 		return ret;
 	}
 
-	ret = ljca_spi_transfer(ljca_spi, xfer->tx_buf, xfer->rx_buf,
-				xfer->len);
-	if (ret < 0)
+	if (first == last)
+		return ljca_spi_transfer(ljca_spi, first->tx_buf, first->rx_buf,
+					 len);
+
+	xfer = first;
+	list_for_each_entry_from (xfer, &msg->transfers, transfer_list) {
+		has_tx |= !!xfer->tx_buf;
+		has_rx |= !!xfer->rx_buf;
+		if (xfer == last)
+			break;
+	}
+
+	if (has_tx) {
+		tx = kzalloc(len, GFP_KERNEL);
+		if (!tx)
+			return -ENOMEM;
+	}
+
+	if (has_rx) {
+		rx = kmalloc(len, GFP_KERNEL);
+		if (!rx) {
+			kfree(tx);
+			return -ENOMEM;
+		}
+	}
+
+	offset = 0;
+	xfer = first;
+	list_for_each_entry_from (xfer, &msg->transfers, transfer_list) {
+		if (xfer->tx_buf)
+			memcpy(tx + offset, xfer->tx_buf, xfer->len);
+		offset += xfer->len;
+		if (xfer == last)
+			break;
+	}
+
+	ret = ljca_spi_transfer(ljca_spi, tx, rx, len);
+	if (!ret && rx) {
+		offset = 0;
+		xfer = first;
+		list_for_each_entry_from (xfer, &msg->transfers,
+					  transfer_list) {
+			if (xfer->rx_buf)
+				memcpy(xfer->rx_buf, rx + offset, xfer->len);
+			offset += xfer->len;
+			if (xfer == last)
+				break;
+		}
+	}
+
+	kfree(rx);
+	kfree(tx);
+	return ret;
+}
+
+/*
+ * Adjacent transfers at the same speed, with no cs_change or delay between
+ * them, are merged into one stream, so a flash command, address and data
+ * phase cost one stream rather than three.
+ */
+static int ljca_spi_transfer_one_message(struct spi_master *master,
+					 struct spi_message *msg)
+{
+	struct ljca_spi_dev *ljca_spi = spi_master_get_devdata(master);
+	struct spi_transfer *first = NULL;
+	struct spi_transfer *xfer;
+	struct spi_transfer *prev = NULL;
+	u32 len = 0;
+	int ret;
+
+	/* one autosuspend session for the whole message */
+	ret = ljca_pm_get(ljca_spi->pdev);
+	if (ret)
+		goto out;
+
+	list_for_each_entry (xfer, &msg->transfers, transfer_list) {
+		if (first && ljca_spi_can_merge(ljca_spi, prev, xfer, len)) {
+			len += xfer->len;
+			prev = xfer;
+			continue;
+		}
+
+		if (first) {
+			ret = ljca_spi_run(ljca_spi, msg, first, prev, len);
+			if (ret)
+				goto put;
+
+			msg->actual_length += len;
+			ljca_spi_xfer_delay(prev);
+		}
+
+		first = xfer;
+		prev = xfer;
+		len = xfer->len;
+	}
+
+	if (first) {
+		ret = ljca_spi_run(ljca_spi, msg, first, prev, len);
+		if (!ret) {
+			msg->actual_length += len;
+			ljca_spi_xfer_delay(prev);
+		}
+	}
+
+put:
+	ljca_pm_put(ljca_spi->pdev);
+out:
+	if (ret)
 		dev_err(&ljca_spi->pdev->dev, "ljca spi transfer failed!\n");
 
+	msg->status = ret;
+	spi_finalize_current_message(master);
 	return ret;
 }
 
+static size_t ljca_spi_max_transfer_size(struct spi_device *spi)
+{
+	return ljca_spi_max_stream(spi_master_get_devdata(spi->master));
+}
+
 static int ljca_spi_probe(struct platform_device *pdev)
 {
 	struct spi_master *master;
 	struct ljca_spi_dev *ljca_spi;
 	struct ljca_platform_data *pdata = dev_get_platdata(&pdev->dev);
 	int ret;
+	int i;
 
 	master = spi_alloc_master(&pdev->dev, sizeof(*ljca_spi));
 	if (!master)
@@ -258,15 +488,21 @@ static int ljca_spi_probe(struct platform_device *pdev)
 	ljca_spi->master = master;
 	ljca_spi->master->dev.of_node = pdev->dev.of_node;
 	ljca_spi->pdev = pdev;
+	ljca_spi->frag_size = min_t(int, LJCA_SPI_MAX_XFER_SIZE,
+				    ljca_max_payload(pdev) -
+					    sizeof(struct spi_xfer_packet));
+	init_waitqueue_head(&ljca_spi->frag_wq);
+	for (i = 0; i < LJCA_SPI_MAX_WINDOW; i++)
+		ljca_spi->frags[i].ljca_spi = ljca_spi;
 
 	ACPI_COMPANION_SET(&ljca_spi->master->dev, ACPI_COMPANION(&pdev->dev));
 
 	master->bus_num = -1;
 	master->mode_bits = SPI_CPHA | SPI_CPOL;
-	master->prepare_message = ljca_spi_prepare_message;
-	master->transfer_one = ljca_spi_transfer_one;
+	master->transfer_one_message = ljca_spi_transfer_one_message;
 	master->auto_runtime_pm = false;
 	master->max_speed_hz = LJCA_SPI_BUS_MAX_HZ;
+	master->max_transfer_size = ljca_spi_max_transfer_size;
 
 	ret = devm_spi_register_master(&pdev->dev, master);
 	if (ret < 0) {
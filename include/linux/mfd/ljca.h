@@ -8,6 +8,12 @@
 
 #define MAX_GPIO_NUM 64
 
+/* DMA-able transmit buffers the bridge has, each holds one message */
+#define LJCA_TX_BUFS 8
+
+struct dentry;
+struct ljca_dev;
+
 struct ljca_gpio_info {
 	int num;
 	DECLARE_BITMAP(valid_pin_map, MAX_GPIO_NUM);
@@ -25,6 +31,8 @@ struct ljca_spi_info {
 };
 
 struct ljca_platform_data {
+	/* the bridge the child belongs to, owned by the mfd driver */
+	struct ljca_dev *ljca;
 	int type;
 	union {
 		struct ljca_gpio_info gpio_info;
@@ -33,15 +41,76 @@ struct ljca_platform_data {
 	};
 };
 
+/*
+ * Called from a work, a stub's events in order. It may sleep but must not
+ * (un)register event callbacks, unregistering waits for it to return.
+ */
 typedef void (*ljca_event_cb_t)(struct platform_device *pdev, u8 cmd,
 				const void *evt_data, int len);
 
+/* called in atomic context once an asynchronous command ended */
+typedef void (*ljca_complete_cb_t)(void *context, int status, int ibuf_len);
+typedef void (*ljca_batch_cb_t)(void *context, int status);
+
+/* one command of a batch, status and ibuf_len are filled on completion */
+struct ljca_xfer {
+	u8 cmd;
+	const void *obuf;
+	int obuf_len;
+	void *ibuf;
+	int ibuf_len;
+	int status;
+};
+
 int ljca_register_event_cb(struct platform_device *pdev,
 			   ljca_event_cb_t event_cb);
 void ljca_unregister_event_cb(struct platform_device *pdev);
+/*
+ * The ACK payload is copied to ibuf, which has room for ljca_max_payload()
+ * bytes, a longer ACK fails the command with -EMSGSIZE.
+ */
 int ljca_transfer(struct platform_device *pdev, u8 cmd, const void *obuf,
 		  int obuf_len, void *ibuf, int *ibuf_len);
 int ljca_transfer_noack(struct platform_device *pdev, u8 cmd, const void *obuf,
 			int obuf_len);
 
+/*
+ * Build a payload in place in one of the bridge's DMA-able transmit buffers.
+ * ljca_get_tx_buf() returns the payload area and its size in @len, it is
+ * released by ljca_transfer_tx_buf() or, without sending, ljca_put_tx_buf().
+ */
+void *ljca_get_tx_buf(struct platform_device *pdev, int *len);
+void ljca_put_tx_buf(struct platform_device *pdev, void *buf);
+int ljca_transfer_tx_buf(struct platform_device *pdev, u8 cmd, void *obuf,
+			 int obuf_len, void *ibuf, int *ibuf_len);
+int ljca_transfer_tx_buf_async(struct platform_device *pdev, u8 cmd,
+			       void *obuf, int obuf_len, void *ibuf,
+			       ljca_complete_cb_t complete, void *context);
+
+/*
+ * Queue commands without waiting for their ACK. These may sleep for a free
+ * transmit buffer. Once they returned 0 the callback runs exactly once,
+ * with the ACK payload copied to ibuf, which must stay valid until then.
+ * The commands of a batch are sent in order and @complete reports the
+ * first error.
+ */
+int ljca_transfer_async(struct platform_device *pdev, u8 cmd,
+			const void *obuf, int obuf_len, void *ibuf,
+			ljca_complete_cb_t complete, void *context);
+int ljca_transfer_batch(struct platform_device *pdev, struct ljca_xfer *xfers,
+			int num, ljca_batch_cb_t complete, void *context);
+
+/* the longest payload one command carries, in either direction */
+int ljca_max_payload(struct platform_device *pdev);
+
+/*
+ * Keep the bridge resumed across a burst of commands. Every ljca_pm_get()
+ * that returned 0 is paired with a ljca_pm_put(), both may sleep.
+ */
+int ljca_pm_get(struct platform_device *pdev);
+void ljca_pm_put(struct platform_device *pdev);
+
+/* the bridge's debugfs directory, children add their files below it */
+struct dentry *ljca_debugfs_dir(struct platform_device *pdev);
+
 #endif